@@ -0,0 +1,249 @@
+// C++ LZMA2 Decoder
+// Decoding many small LZMA2 streams at once
+// Placed in the public domain
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include "Lzma2Decoder.hpp"
+#include "Lzma2DecoderPool.hpp"
+
+namespace lzma
+{
+    /// One stream of Lzma2DecodeBatch.
+    struct BatchItem
+    {
+        const void* src;
+        std::size_t srcLen;  ///< in: the stream size, out: the bytes used
+        void* dest;
+        std::size_t destLen; ///< in: the room in dest, out: the bytes decoded
+        unsigned prop;
+        Status status;       ///< as from Lzma2Decode with FinishMode::End
+        bool bad;            ///< the stream is invalid, status is NotSpecified
+    };
+
+    namespace details
+    {
+        /// A decoder of BatchDecoder, and the stream it is on.
+        template<typename Decoder>
+        struct BatchLane
+        {
+            typename Decoder::Core::FastRun run;
+            bool running; ///< in the fast loop run
+            Decoder* decoder;
+            BatchItem* item; ///< nullptr when there are no streams left
+            const Byte* src;
+            std::size_t srcLeft;
+        };
+
+        /** Steps through the fast loops of the running lanes in turns, a symbol of each, starting at lane,
+        until one of them stops: lane is set to it. The symbols of different lanes don't depend on each other,
+        so the CPU overlaps them. At least one lane must be running. */
+        template<typename Decoder, std::size_t NumLanes>
+        inline void StepLanes(BatchLane<Decoder>* lanes, std::size_t& lane)
+        {
+            for (;; lane = 0)
+            {
+                for (; lane != NumLanes; ++lane)
+                {
+                    if (lanes[lane].running && !lanes[lane].decoder->decoder.StepFastRun(lanes[lane].run))
+                        return;
+                }
+            }
+        }
+
+#if defined(LZMA_CPU_DISPATCH)
+        template<typename Decoder, std::size_t NumLanes>
+        LZMA_TARGET_AVX2 void StepLanesAvx2(BatchLane<Decoder>* lanes, std::size_t& lane)
+        {
+            StepLanes<Decoder, NumLanes>(lanes, lane);
+        }
+#endif
+
+        /** Lzma2DecodeBatch with NumLanes decoders: each takes the next stream when its own ends. The fast loops
+        of the chunks run interleaved by StepLanes, the rest of a stream (chunk headers, stored chunks,
+        the last bytes of the input) is decoded by the lane alone. */
+        template<typename Decoder, std::size_t NumLanes>
+        class BatchDecoder
+        {
+        public:
+            BatchDecoder(BatchItem* items, std::size_t count)
+                : m_items(items), m_count(count), m_next(0), m_numBad(0), m_numRunning(0), m_numLanes(0)
+            {
+                for (auto& lane : m_lanes)
+                {
+                    lane.running = false;
+                    lane.decoder = nullptr;
+                    lane.item = nullptr;
+                }
+
+                // fewer lanes than NumLanes for a small batch: the others are never running
+                for (; m_numLanes != NumLanes && m_numLanes != count; ++m_numLanes)
+                {
+#if defined(LZMA_HAS_THREAD_LOCAL)
+                    m_decoders[m_numLanes] = DecoderPool<Decoder>::ThreadLocal().Acquire(items[m_numLanes].prop);
+#else
+                    m_decoders[m_numLanes].reset(new Decoder(items[m_numLanes].prop));
+#endif
+                    m_lanes[m_numLanes].decoder = m_decoders[m_numLanes].get();
+                    m_lanes[m_numLanes].decoder->decoder.m_yieldFastRuns = (NumLanes > 1);
+                }
+            }
+
+            ~BatchDecoder()
+            {
+                for (std::size_t i = 0; i != m_numLanes; ++i)
+                    m_lanes[i].decoder->decoder.m_yieldFastRuns = false;
+            }
+
+            /// Decodes all the streams, returns the number of bad ones.
+            std::size_t Run()
+            {
+                for (std::size_t i = 0; i != m_numLanes; ++i)
+                    Advance(m_lanes[i]);
+
+                std::size_t lane = 0;
+                while (m_numRunning != 0)
+                {
+                    try
+                    {
+#if defined(LZMA_CPU_DISPATCH)
+                        if (m_lanes[0].decoder->decoder.RunsAvx2())
+                            StepLanesAvx2<Decoder, NumLanes>(m_lanes, lane);
+                        else
+#endif
+                            StepLanes<Decoder, NumLanes>(m_lanes, lane);
+
+                        auto& stopped = m_lanes[lane];
+                        std::size_t srcLen;
+                        if (stopped.decoder->EndFastRun(stopped.run, srcLen))
+                            continue;
+
+                        stopped.running = false;
+                        --m_numRunning;
+                        stopped.src += srcLen;
+                        stopped.srcLeft -= srcLen;
+                    }
+                    catch (BadStream&)
+                    {
+                        m_lanes[lane].running = false;
+                        --m_numRunning;
+                        Finish(m_lanes[lane], true);
+                    }
+
+                    Advance(m_lanes[lane]);
+                    ++lane;
+                }
+
+                return m_numBad;
+            }
+
+        private:
+            BatchDecoder(const BatchDecoder&); // = delete;
+            void operator=(const BatchDecoder&); // = delete;
+
+            /// Decodes the stream of lane up to its next fast loop, taking the next streams as the streams end.
+            void Advance(BatchLane<Decoder>& lane)
+            {
+                for (;;)
+                {
+                    if (lane.item == nullptr)
+                    {
+                        if (m_next == m_count)
+                            return;
+
+                        Start(lane, m_items[m_next++]);
+                    }
+
+                    try
+                    {
+                        auto srcLen = lane.srcLeft;
+                        lane.decoder->DecodeToDic(lane.item->destLen, lane.src, srcLen, FinishMode::End, lane.item->status);
+                        lane.src += srcLen;
+                        lane.srcLeft -= srcLen;
+
+                        if (lane.decoder->decoder.AtFastRun())
+                        {
+                            lane.run = lane.decoder->decoder.BeginFastRun();
+                            lane.running = true;
+                            ++m_numRunning;
+                            return;
+                        }
+
+                        Finish(lane, false);
+                    }
+                    catch (BadStream&)
+                    {
+                        Finish(lane, true);
+                    }
+                }
+            }
+
+            void Start(BatchLane<Decoder>& lane, BatchItem& item)
+            {
+                lane.decoder->Reset(item.prop);
+
+                auto& dic = lane.decoder->decoder.m_dic;
+                dic.mem = static_cast<Byte*>(item.dest);
+                dic.size = item.destLen;
+
+                lane.item = &item;
+                lane.src = static_cast<const Byte*>(item.src);
+                lane.srcLeft = item.srcLen;
+            }
+
+            void Finish(BatchLane<Decoder>& lane, bool bad)
+            {
+                auto& item = *lane.item;
+                item.srcLen -= lane.srcLeft;
+                item.destLen = lane.decoder->decoder.m_dic.pos;
+                item.bad = bad;
+
+                if (bad)
+                {
+                    item.status = Status::NotSpecified;
+                    ++m_numBad;
+                }
+
+                lane.item = nullptr;
+            }
+
+            BatchItem* m_items;
+            std::size_t m_count;
+            std::size_t m_next;
+            std::size_t m_numBad;
+            std::size_t m_numRunning;
+            std::size_t m_numLanes;
+            BatchLane<Decoder> m_lanes[NumLanes];
+#if defined(LZMA_HAS_THREAD_LOCAL)
+            typename DecoderPool<Decoder>::Handle m_decoders[NumLanes];
+#else
+            std::unique_ptr<Decoder> m_decoders[NumLanes];
+#endif
+        };
+    }
+
+    /**
+    Decodes independent LZMA2 streams, each right into its dest, like Lzma2Decode with FinishMode::End.
+    The decoders come from the thread's DecoderPool where there is one, see LZMA_HAS_THREAD_LOCAL.
+
+    One stream is a serial chain of range decoder steps. With NumLanes > 1, the streams are decoded
+    NumLanes at a time, a symbol of each in turn, so that the CPU can overlap the chains. But the
+    decoding loop is bound by mispredicted branches more than by its chains, and on the machines
+    measured so far the lanes were 5-10% slower than one stream after another, see decoder_bench.
+
+    Returns the number of bad streams, which don't stop the others.
+    Throws std::invalid_argument if a prop is invalid, before anything is decoded.
+    */
+    template<std::size_t NumLanes = 1>
+    std::size_t Lzma2DecodeBatch(BatchItem* items, std::size_t count)
+    {
+        for (std::size_t i = 0; i != count; ++i)
+            LinearDecoder2::GetMemoryNeeds(items[i].prop);
+
+        details::BatchDecoder<LinearDecoder2, NumLanes> batch(items, count);
+        return batch.Run();
+    }
+}
@@ -0,0 +1,178 @@
+// C++ LZMA2 Decoder
+// Checkpoints for seeking in LZMA2 streams without dictionary resets
+// Placed in the public domain
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "Lzma2Decoder.hpp"
+
+namespace lzma
+{
+    /// A saved decoder (see BasicDecoder2::SaveCheckpoint) and the place in the stream it goes on from.
+    struct Checkpoint
+    {
+        std::uint64_t packedOffset;   ///< the header of the next chunk
+        std::uint64_t unpackedOffset; ///< the first byte of the next chunk in the output
+        std::vector<Byte> state;
+    };
+
+    typedef std::vector<Checkpoint> Checkpoints;
+
+    /**
+    Decodes a complete LZMA2 stream and saves the decoder at the first chunk boundary after every
+    interval bytes of output. Each checkpoint holds up to a dictionary size of output, so interval
+    trades the size of the checkpoints for the time of a seek. Chunks that reset the dictionary
+    need no checkpoint: Lzma2DecodeRange can start there anyway.
+
+    index - ScanChunks(src, srcLen).
+    Throws BadStream if the stream is invalid.
+    */
+    inline Checkpoints MakeCheckpoints(const void* src, std::size_t srcLen, unsigned prop, std::uint64_t interval, const ChunkIndex& index)
+    {
+        Decoder2 decoder(prop);
+        auto dicSize = (std::size_t)std::min<std::uint64_t>(decoder.decoder.m_properties.dicSize, index.unpackedSize);
+        std::unique_ptr<Byte[]> dic(new Byte[std::max<std::size_t>(dicSize, 1)]);
+        decoder.decoder.m_dic.mem = dic.get();
+        decoder.decoder.m_dic.size = dicSize;
+
+        auto srcBytes = static_cast<const Byte*>(src);
+        auto inSize = srcLen;
+
+        Checkpoints checkpoints;
+        std::uint64_t last = 0;
+        for (std::size_t i = 0; i != index.chunks.size(); ++i)
+        {
+            auto& chunk = index.chunks[i];
+            if (chunk.resetsDic)
+                last = chunk.unpackedOffset;
+
+            details::DecodeThroughRing(decoder, srcBytes, inSize, chunk.unpackedSize, nullptr, 0);
+
+            if (i + 1 == index.chunks.size() || index.chunks[i + 1].resetsDic)
+                continue;
+
+            auto next = chunk.unpackedOffset + chunk.unpackedSize;
+            if (next - last < interval)
+                continue;
+
+            if (!decoder.AtChunkBoundary())
+                throw BadStream(); // the chunk data is longer than its output
+
+            Checkpoint checkpoint = { chunk.packedOffset + chunk.packedSize, next, decoder.SaveCheckpoint() };
+            checkpoints.push_back(std::move(checkpoint));
+            last = next;
+        }
+
+        return checkpoints;
+    }
+
+    /* The sidecar format of Checkpoints, all numbers little-endian:
+        "LZ2C", uint32 count,
+        count times: uint64 packedOffset, uint64 unpackedOffset, uint32 state size, state
+    */
+
+    inline std::vector<Byte> WriteCheckpoints(const Checkpoints& checkpoints)
+    {
+        typedef details::Decoder2Base Base;
+
+        std::vector<Byte> out = { 'L', 'Z', '2', 'C' };
+        Base::PutUInt32(out, (std::uint32_t)checkpoints.size());
+        for (auto& checkpoint : checkpoints)
+        {
+            Base::PutUInt32(out, (std::uint32_t)checkpoint.packedOffset);
+            Base::PutUInt32(out, (std::uint32_t)(checkpoint.packedOffset >> 32));
+            Base::PutUInt32(out, (std::uint32_t)checkpoint.unpackedOffset);
+            Base::PutUInt32(out, (std::uint32_t)(checkpoint.unpackedOffset >> 32));
+            Base::PutUInt32(out, (std::uint32_t)checkpoint.state.size());
+            out.insert(out.end(), checkpoint.state.begin(), checkpoint.state.end());
+        }
+
+        return out;
+    }
+
+    /// Reads WriteCheckpoints. Throws std::invalid_argument if the data is not in that format.
+    inline Checkpoints ReadCheckpoints(const void* data, std::size_t size)
+    {
+        typedef details::Decoder2Base Base;
+
+        auto p = static_cast<const Byte*>(data);
+        auto end = p + size;
+        auto need = [&](std::size_t n)
+        {
+            if ((std::size_t)(end - p) < n)
+                throw std::invalid_argument("checkpoints");
+        };
+
+        need(8);
+        if (p[0] != 'L' || p[1] != 'Z' || p[2] != '2' || p[3] != 'C')
+            throw std::invalid_argument("checkpoints");
+
+        auto count = Base::GetUInt32(p + 4);
+        p += 8;
+
+        Checkpoints checkpoints;
+        for (std::uint32_t i = 0; i != count; ++i)
+        {
+            need(20);
+            Checkpoint checkpoint;
+            checkpoint.packedOffset = Base::GetUInt32(p) | ((std::uint64_t)Base::GetUInt32(p + 4) << 32);
+            checkpoint.unpackedOffset = Base::GetUInt32(p + 8) | ((std::uint64_t)Base::GetUInt32(p + 12) << 32);
+            std::size_t stateSize = Base::GetUInt32(p + 16);
+            p += 20;
+
+            need(stateSize);
+            checkpoint.state.assign(p, p + stateSize);
+            p += stateSize;
+
+            if (!checkpoints.empty() && checkpoint.unpackedOffset <= checkpoints.back().unpackedOffset)
+                throw std::invalid_argument("checkpoints");
+
+            checkpoints.push_back(std::move(checkpoint));
+        }
+
+        return checkpoints;
+    }
+
+    /**
+    Lzma2DecodeRange that starts at the last checkpoint before offset if it is after the last dictionary reset.
+    checkpoints - MakeCheckpoints of the same stream.
+    */
+    inline std::size_t Lzma2DecodeRange(void* dest, std::uint64_t offset, std::size_t length,
+        const void* src, std::size_t srcLen, unsigned prop, const ChunkIndex& index, const Checkpoints& checkpoints)
+    {
+        auto checkpoint = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset,
+            [](std::uint64_t pos, const Checkpoint& c) { return pos < c.unpackedOffset; });
+
+        if (offset >= index.unpackedSize || checkpoint == checkpoints.begin())
+            return Lzma2DecodeRange(dest, offset, length, src, srcLen, prop, index);
+
+        auto lastReset = details::LastDicReset(index, offset).unpackedOffset;
+        if ((--checkpoint)->unpackedOffset <= lastReset)
+            return Lzma2DecodeRange(dest, offset, length, src, srcLen, prop, index);
+
+        length = (std::size_t)std::min<std::uint64_t>(length, index.unpackedSize - offset);
+
+        // the checkpoint restores the output since lastReset, up to the dictionary size
+        Decoder2 decoder(prop);
+        auto dicSize = (std::size_t)std::min<std::uint64_t>(decoder.decoder.m_properties.dicSize, offset + length - lastReset);
+        std::unique_ptr<Byte[]> dic(new Byte[dicSize]);
+        decoder.decoder.m_dic.mem = dic.get();
+        decoder.decoder.m_dic.size = dicSize;
+        decoder.RestoreCheckpoint(checkpoint->state.data(), checkpoint->state.size());
+
+        if (checkpoint->packedOffset > srcLen)
+            throw std::invalid_argument("checkpoints");
+
+        auto srcBytes = static_cast<const Byte*>(src) + checkpoint->packedOffset;
+        auto inSize = srcLen - (std::size_t)checkpoint->packedOffset;
+        details::DecodeThroughRing(decoder, srcBytes, inSize, offset - checkpoint->unpackedOffset, static_cast<Byte*>(dest), length);
+        return length;
+    }
+}
@@ -5,17 +5,129 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <stdexcept>
+#include <vector>
+
+#if defined(__has_include)
+#   if __has_include(<memory_resource>) && __cplusplus >= 201703L
+#       include <memory_resource>
+#       define LZMA_HAS_PMR
+#   endif
+#endif
 
 #include "details/LzmaDecoderCore.hpp"
 
 namespace lzma
 {
+    /** Where decoders get their arrays: the probabilities and BufDecoder2's dictionary.
+    It has the interface of std::pmr::memory_resource, which needs C++17, see PmrMemoryResource. */
+    class MemoryResource
+    {
+    public:
+        virtual ~MemoryResource() {}
+        virtual void* Allocate(std::size_t size, std::size_t alignment) = 0;
+        virtual void Deallocate(void* p, std::size_t size, std::size_t alignment) = 0;
+    };
+
+    /// new and delete, what the decoders use unless they are given memory.
+    inline MemoryResource& DefaultMemoryResource()
+    {
+        struct NewDeleteResource : MemoryResource
+        {
+            virtual void* Allocate(std::size_t size, std::size_t) override { return ::operator new(size); }
+            virtual void Deallocate(void* p, std::size_t, std::size_t) override { ::operator delete(p); }
+        };
+
+        static NewDeleteResource resource;
+        return resource;
+    }
+
+#if defined(LZMA_HAS_PMR)
+    /// A MemoryResource over a std::pmr::memory_resource, which must outlive it.
+    class PmrMemoryResource : public MemoryResource
+    {
+    public:
+        explicit PmrMemoryResource(std::pmr::memory_resource& resource) : m_resource(resource) {}
+
+        virtual void* Allocate(std::size_t size, std::size_t alignment) override { return m_resource.allocate(size, alignment); }
+        virtual void Deallocate(void* p, std::size_t size, std::size_t alignment) override { m_resource.deallocate(p, size, alignment); }
+
+    private:
+        std::pmr::memory_resource& m_resource;
+    };
+#endif
+
+    /// Sizes in bytes of the arrays a decoder needs for a prop byte, see BasicDecoder2::GetMemoryNeeds.
+    struct MemoryNeeds
+    {
+        std::size_t probsSize; ///< aligned for the probability type
+        std::size_t dicSize;   ///< the whole dictionary, for BufDecoder2 or the caller's m_dic
+    };
+
     namespace details
     {
+        /// An array from a MemoryResource, or in the caller's memory, which it doesn't free.
+        template<typename T>
+        class ResourceArray
+        {
+        public:
+            ResourceArray() : m_data(nullptr), m_size(0), m_resource(nullptr) {}
+            ~ResourceArray() { Release(); }
+
+            void Allocate(MemoryResource& resource, std::size_t size)
+            {
+                auto data = static_cast<T*>(resource.Allocate(size * sizeof(T), LZMA_ALIGNOF(T)));
+                Release();
+                m_data = data;
+                m_size = size;
+                m_resource = &resource;
+            }
+
+            /// Throws std::invalid_argument(name) if size Ts don't fit in the bytes at mem.
+            void Attach(void* mem, std::size_t bytes, std::size_t size, const char* name)
+            {
+                if (mem == nullptr || bytes / sizeof(T) < size || reinterpret_cast<std::uintptr_t>(mem) % LZMA_ALIGNOF(T) != 0)
+                    throw std::invalid_argument(name);
+
+                Release();
+                m_data = static_cast<T*>(mem);
+                m_size = size;
+            }
+
+            void swap(ResourceArray& other)
+            {
+                std::swap(m_data, other.m_data);
+                std::swap(m_size, other.m_size);
+                std::swap(m_resource, other.m_resource);
+            }
+
+            T* get() const { return m_data; }
+            std::size_t size() const { return m_size; }
+            T& operator[](std::size_t i) const { return m_data[i]; }
+
+        private:
+            ResourceArray(const ResourceArray&); // = delete;
+            void operator=(const ResourceArray&); // = delete;
+
+            T* m_data;
+            std::size_t m_size;
+            MemoryResource* m_resource; ///< null for the caller's memory
+
+            void Release()
+            {
+                if (m_resource != nullptr)
+                    m_resource->Deallocate(m_data, m_size * sizeof(T), LZMA_ALIGNOF(T));
+
+                m_data = nullptr;
+                m_size = 0;
+                m_resource = nullptr;
+            }
+        };
+
         /*
         00000000  -  EOS
         00000001 U U  -  Uncompressed Reset Dic
@@ -55,32 +167,70 @@ namespace lzma
 
             static bool isThereProp(unsigned mode) { return mode >= 2; }
 
+            /// control, unpack size, pack size and props
+            static const auto kMaxChunkHeaderSize = 6;
+
             static const auto LC_PLUS_LP_MAX = 4;
 
             static unsigned dicSizeFromProp(unsigned prop)
             {
                 return (2ul | (prop & 1)) << (prop / 2 + 11);
             }
+
+            // checkpoints are little-endian
+            static void PutUInt32(std::vector<Byte>& out, std::uint32_t v)
+            {
+                for (auto i = 0; i != 4; ++i)
+                    out.push_back(Byte(v >> (8 * i)));
+            }
+
+            static std::uint32_t GetUInt32(const Byte* p)
+            {
+                return (std::uint32_t)p[0] | ((std::uint32_t)p[1] << 8) | ((std::uint32_t)p[2] << 16) | ((std::uint32_t)p[3] << 24);
+            }
         };
     }
 
-    class Decoder2 : private details::Decoder2Base
+    /// Traits configure the decoder, see DefaultTraits.
+    template<typename Traits>
+    class BasicDecoder2 : private details::Decoder2Base
     {
     public:
-        explicit Decoder2(unsigned prop)
+        typedef details::DecoderCore<Traits> Core;
+
+        explicit BasicDecoder2(unsigned prop)
         {
-            if (prop > 40)
-                throw std::invalid_argument("prop");
+            InitProp(prop);
+            m_probsArr.Allocate(DefaultMemoryResource(), Core::calcProbSize(LC_PLUS_LP_MAX));
+            InitProbs();
+        }
 
-            decoder.m_properties.lc = LC_PLUS_LP_MAX;
-            decoder.m_properties.lp = 0;
-            decoder.m_properties.pb = 0;
-            decoder.m_properties.dicSize = (prop == 40) ? 0xFFFFFFFF : dicSizeFromProp(prop);
+        /// The probabilities come from resource, which must outlive the decoder.
+        BasicDecoder2(unsigned prop, MemoryResource& resource)
+        {
+            InitProp(prop);
+            m_probsArr.Allocate(resource, Core::calcProbSize(LC_PLUS_LP_MAX));
+            InitProbs();
+        }
 
-            m_probsArr.reset(new lzma::details::Prob[lzma::details::DecoderCore::calcProbSize(LC_PLUS_LP_MAX)]);
-            decoder.m_probs = &m_probsArr[0];
+        /** probs - the caller's memory for the probabilities, GetMemoryNeeds(prop).probsSize bytes aligned for
+        Core::Prob, it must outlive the decoder. Throws std::invalid_argument if it doesn't fit. */
+        BasicDecoder2(unsigned prop, void* probs, std::size_t probsSize)
+        {
+            InitProp(prop);
+            m_probsArr.Attach(probs, probsSize, Core::calcProbSize(LC_PLUS_LP_MAX), "probs");
+            InitProbs();
+        }
 
-            Reset();
+        /// What the constructors allocate, or need from the caller. Throws std::invalid_argument if prop is invalid.
+        static MemoryNeeds GetMemoryNeeds(unsigned prop)
+        {
+            if (prop > 40)
+                throw std::invalid_argument("prop");
+
+            MemoryNeeds needs = { Core::calcProbSize(LC_PLUS_LP_MAX) * sizeof(typename Core::Prob),
+                (prop == 40) ? 0xFFFFFFFF : dicSizeFromProp(prop) };
+            return needs;
         }
 
         void Reset()
@@ -94,6 +244,185 @@ namespace lzma
             decoder.InitDicAndState(true, true);
         }
 
+        /** Reset for a stream with another prop byte, that is another dictionary size. The probabilities
+        are kept, the caller's m_dic must fit the new size. Throws std::invalid_argument if prop is invalid. */
+        void Reset(unsigned prop)
+        {
+            decoder.m_properties.dicSize = (std::uint32_t)GetMemoryNeeds(prop).dicSize;
+            Reset();
+        }
+
+        /** Starts decoding in the middle of a stream, at a chunk that resets the state.
+        processed - bytes decoded since the last dictionary reset, they must be in the dictionary before m_dic.pos;
+        props - lc, lp and pb in effect, see ChunkInfo::props. */
+        void ResumeAt(std::uint64_t processed, unsigned props)
+        {
+            state = LZMA2_STATE_CONTROL;
+            needInitDic = false;
+            needInitState = true;
+
+            decoder.InitDicAndState(false, true);
+            if (UpdateProp(props) == LZMA2_STATE_ERROR)
+                throw std::invalid_argument("props");
+
+            decoder.SetProcessedSize(processed);
+        }
+
+        /// True between two chunks, where SaveCheckpoint can be called.
+        bool AtChunkBoundary() const
+        {
+            // a chunk whose data is all used is left in LZMA2_STATE_DATA_CONT until the next call
+            return state == LZMA2_STATE_CONTROL || state == LZMA2_STATE_FINISHED ||
+                (state == LZMA2_STATE_DATA_CONT && unpackSize == 0 && (isUncompressedState() || packSize == 0));
+        }
+
+        /** Saves the decoder between two chunks, see AtChunkBoundary, for RestoreCheckpoint: the state,
+        the probabilities and the output since the last dictionary reset, up to the dictionary size,
+        which must be in m_dic before m_dic.pos. The range coder starts anew in every chunk. */
+        std::vector<Byte> SaveCheckpoint() const
+        {
+            if (!AtChunkBoundary() || state == LZMA2_STATE_FINISHED)
+                throw std::logic_error("not between two chunks");
+
+            auto core = decoder.GetChunkBoundaryState();
+            auto& props = decoder.m_properties;
+
+            std::vector<Byte> out;
+            out.push_back(Byte(kCheckpointVersion));
+            out.push_back(Byte(kCheckpointLayout));
+            out.push_back(Byte((needInitDic ? 1 : 0) | (needInitState ? 2 : 0) | (needInitProp ? 4 : 0) | (core.needInitState ? 8 : 0)));
+            out.push_back(Byte((props.pb * 5 + props.lp) * 9 + props.lc));
+            PutUInt32(out, props.dicSize);
+            PutUInt32(out, core.processedPos);
+            PutUInt32(out, core.checkDicSize);
+            PutUInt32(out, core.state);
+            for (auto rep : core.reps)
+                PutUInt32(out, rep);
+
+            // the next LZMA chunk resets the probabilities, or they are in use
+            std::size_t numProbs = (needInitState || core.needInitState) ? 0 : Core::calcProbSize(props.lc + props.lp);
+            PutUInt32(out, (std::uint32_t)numProbs);
+            for (std::size_t i = 0; i != numProbs; ++i)
+            {
+                out.push_back(Byte(m_probsArr[i]));
+                out.push_back(Byte(m_probsArr[i] >> 8));
+            }
+
+            std::size_t windowSize = needInitDic ? 0 : (core.checkDicSize != 0 ? props.dicSize : core.processedPos);
+            auto& dic = decoder.m_dic;
+            if (windowSize > (Traits::Window::wraps ? dic.size : dic.pos))
+                throw std::logic_error("the dictionary doesn't hold the window");
+
+            PutUInt32(out, (std::uint32_t)windowSize);
+            auto from = (dic.pos >= windowSize) ? dic.pos - windowSize : dic.pos + dic.size - windowSize;
+            auto firstPart = std::min(windowSize, dic.size - from);
+            out.insert(out.end(), dic.mem + from, dic.mem + from + firstPart);
+            out.insert(out.end(), dic.mem, dic.mem + (windowSize - firstPart));
+            return out;
+        }
+
+        /** Restores SaveCheckpoint of a decoder with the same prop. The saved output is copied to m_dic.mem + m_dic.pos,
+        and the decoding goes on with the chunk after the checkpoint.
+        Throws std::invalid_argument if the checkpoint is bad or doesn't fit in m_dic. */
+        void RestoreCheckpoint(const void* data, std::size_t size)
+        {
+            auto p = static_cast<const Byte*>(data);
+            auto end = p + size;
+            auto need = [&](std::size_t n)
+            {
+                if ((std::size_t)(end - p) < n)
+                    throw std::invalid_argument("checkpoint");
+            };
+
+            need(4 + 4 * 9);
+            auto flags = p[2];
+            auto props = p[3];
+            if (p[0] != kCheckpointVersion || p[1] != kCheckpointLayout || GetUInt32(p + 4) != decoder.m_properties.dicSize)
+                throw std::invalid_argument("checkpoint");
+
+            typename Core::ChunkBoundaryState core;
+            core.needInitState = (flags & 8) != 0;
+            core.processedPos = GetUInt32(p + 8);
+            core.checkDicSize = GetUInt32(p + 12);
+            core.state = GetUInt32(p + 16);
+            for (auto i = 0; i != 4; ++i)
+                core.reps[i] = GetUInt32(p + 20 + 4 * i);
+            std::size_t numProbs = GetUInt32(p + 36);
+            p += 40;
+
+            auto dicSize = decoder.m_properties.dicSize;
+            if (core.checkDicSize != 0 ? core.checkDicSize != dicSize : core.processedPos >= dicSize)
+                throw std::invalid_argument("checkpoint");
+
+            // the next chunk decodes with the reps unless it resets the state, they must reach into the window
+            if ((flags & (2 | 8)) == 0)
+            {
+                auto window = core.checkDicSize != 0 ? core.checkDicSize : core.processedPos;
+                for (auto rep : core.reps)
+                {
+                    if (rep == 0 || rep > window)
+                        throw std::invalid_argument("checkpoint");
+                }
+            }
+
+            // the props the chunk after the checkpoint decodes with, unless it sets them
+            auto lcPlusLp = decoder.m_properties.lc + decoder.m_properties.lp;
+            if ((flags & 4) == 0)
+            {
+                if (props >= 9 * 5 * 5 || props % 9 + props / 9 % 5 > LC_PLUS_LP_MAX)
+                    throw std::invalid_argument("checkpoint");
+
+                lcPlusLp = props % 9 + props / 9 % 5;
+            }
+
+            if (numProbs != 0 && numProbs != Core::calcProbSize(lcPlusLp))
+                throw std::invalid_argument("checkpoint");
+
+            need(2 * numProbs);
+            auto probs = p;
+            for (std::size_t i = 0; i != numProbs; ++i, p += 2)
+            {
+                auto prob = p[0] | (p[1] << 8);
+                if (prob == 0 || prob >= 2048)
+                    throw std::invalid_argument("checkpoint");
+            }
+
+            need(4);
+            std::size_t windowSize = GetUInt32(p);
+            p += 4;
+            need(windowSize);
+
+            // matches may reach back that far
+            if (windowSize != ((flags & 1) != 0 ? 0 : (core.checkDicSize != 0 ? dicSize : core.processedPos)))
+                throw std::invalid_argument("checkpoint");
+
+            auto& dic = decoder.m_dic;
+            if (dic.size - dic.pos < windowSize)
+                throw std::invalid_argument("dictionary");
+
+            // all checked: SetChunkBoundaryState throws on a bad state before it changes anything, the rest doesn't throw
+            decoder.SetChunkBoundaryState(core);
+
+            state = LZMA2_STATE_CONTROL;
+            needInitDic = (flags & 1) != 0;
+            needInitState = (flags & 2) != 0;
+            needInitProp = true;
+            if ((flags & 4) == 0)
+                UpdateProp(props);
+
+            for (std::size_t i = 0; i != numProbs; ++i, probs += 2)
+                m_probsArr[i] = (typename Core::Prob)(probs[0] | (probs[1] << 8));
+
+            memcpy(dic.mem + dic.pos, p, windowSize);
+            dic.pos += windowSize;
+        }
+
+        /// Counters of Traits::Stats, accumulated since the construction
+        const typename Core::Stats& GetStats() const
+        {
+            return decoder.m_stats;
+        }
+
         /**
             finishMode:
             It has meaning only if the decoding reaches output limit (*destLen or dicLimit).
@@ -107,8 +436,14 @@ namespace lzma
             LZMA_STATUS_NOT_FINISHED
             LZMA_STATUS_NEEDS_MORE_INPUT
             SZ_ERROR_DATA - Data error
+
+            slack:
+            InputSlack::Padded - at least InputPaddingSize readable bytes follow the input.
+            Unlike DecoderCore, the input doesn't have to hold the rest of the stream:
+            the fast loop is used only for chunks which are completely in the input.
         */
-        void DecodeToDic(std::size_t dicLimit, const void* src, std::size_t& srcLen, FinishMode finishMode, Status& status)
+        void DecodeToDic(std::size_t dicLimit, const void* src, std::size_t& srcLen, FinishMode finishMode, Status& status,
+            InputSlack slack = InputSlack::None)
         {
             auto srcBytes = static_cast<const Byte*>(src);
             auto inSize = srcLen;
@@ -129,6 +464,14 @@ namespace lzma
 
                 if (this->state != LZMA2_STATE_DATA && this->state != LZMA2_STATE_DATA_CONT)
                 {
+                    if (this->state == LZMA2_STATE_CONTROL && inSize - srcLen >= kMaxChunkHeaderSize)
+                    {
+                        auto headerSize = ParseChunkHeader(srcBytes);
+                        srcLen += headerSize;
+                        srcBytes += headerSize;
+                        continue;
+                    }
+
                     if (srcLen == inSize)
                     {
                         status = Status::NeedsMoreInput;
@@ -153,6 +496,12 @@ namespace lzma
 
                     if (isUncompressedState())
                     {
+                        if (m_stopAtStored)
+                        {
+                            status = Status::NotFinished;
+                            return;
+                        }
+
                         if (srcLen == inSize)
                         {
                             status = Status::NeedsMoreInput;
@@ -160,22 +509,7 @@ namespace lzma
                         }
 
                         if (this->state == LZMA2_STATE_DATA)
-                        {
-                            auto initDic = (this->control == CONTROL_COPY_RESET_DIC);
-
-                            if (initDic)
-                            {
-                                this->needInitProp = true;
-                                this->needInitState = true;
-                            }
-                            else if (this->needInitDic)
-                            {
-                                throw BadStream();
-                            }
-
-                            this->needInitDic = false;
-                            this->decoder.InitDicAndState(initDic, false);
-                        }
+                            BeginStoredChunk();
 
                         if (srcSizeCur > destSizeCur)
                             srcSizeCur = destSizeCur;
@@ -208,7 +542,16 @@ namespace lzma
                         if (srcSizeCur > this->packSize)
                             srcSizeCur = this->packSize;
 
-                        this->decoder.DecodeToDic(dicPos + destSizeCur, srcBytes, srcSizeCur, curFinishMode, status);
+                        // When the rest of the chunk is here, the bytes after it (the next chunk or the caller's
+                        // padding) let the core run its fast loop to the end of the chunk.
+                        auto chunkSlack = InputSlack::None;
+                        if (srcSizeCur == this->packSize &&
+                            (slack == InputSlack::Padded || inSize - srcLen - srcSizeCur >= InputPaddingSize))
+                        {
+                            chunkSlack = InputSlack::Padded;
+                        }
+
+                        this->decoder.DecodeToDic(dicPos + destSizeCur, srcBytes, srcSizeCur, curFinishMode, status, chunkSlack);
 
                         srcBytes += srcSizeCur;
                         srcLen += srcSizeCur;
@@ -217,7 +560,7 @@ namespace lzma
                         auto outSizeProcessed = this->decoder.m_dic.pos - dicPos;
                         this->unpackSize -= outSizeProcessed;
 
-                        if (status == Status::NeedsMoreInput)
+                        if (status == Status::NeedsMoreInput || this->decoder.AtFastRun())
                             return;
 
                         if (srcSizeCur == 0 && outSizeProcessed == 0)
@@ -236,13 +579,80 @@ namespace lzma
             status = Status::FinishedWithMark;
         }
 
-        lzma::details::DecoderCore decoder;
+        /** Internal. (Used by Lzma2DecodeBatch) Core::EndFastRun, counting what the run has used of the chunk.
+        With Core::m_yieldFastRuns, DecodeToDic returns NotFinished at a fast loop of the core, see Core::FastRun. */
+        bool EndFastRun(typename Core::FastRun& run, std::size_t& srcLen)
+        {
+            if (decoder.EndFastRun(run, srcLen))
+                return true;
+
+            this->packSize -= srcLen;
+            this->unpackSize -= decoder.m_dic.pos - run.dicStart;
+            return false;
+        }
+
+        Core decoder;
+
+    protected:
+        /// What the next chunk does with the dictionary, see NextDicUse.
+        enum class DicUse
+        {
+            Refers, ///< it may refer to the bytes before it
+            Stored, ///< another stored chunk, it doesn't but the chunk after it may
+            None    ///< the stream ends or the dictionary is reset
+        };
+
+        /// Set by BufDecoder2, which copies stored chunks itself: DecodeToDic stops at their data.
+        bool m_stopAtStored;
+
+        /// No chunk decoded since Reset: the first one resets the dictionary.
+        bool BeforeFirstChunk() const { return needInitDic; }
+
+        /// In the data of a stored chunk, see CopyStored.
+        bool AtStoredData() const
+        {
+            return (state == LZMA2_STATE_DATA || state == LZMA2_STATE_DATA_CONT) && isUncompressedState() && unpackSize != 0;
+        }
+
+        /** Copies up to destSize bytes of the stored chunk at src to dest. m_dic.pos moves past them as if they
+        were in the dictionary, so there must be room for them before m_dic.size. Returns the number of bytes. */
+        std::size_t CopyStored(Byte* dest, std::size_t destSize, const Byte* src, std::size_t srcSize)
+        {
+            auto size = std::min(std::min(destSize, srcSize), unpackSize);
+            if (size == 0)
+                return 0;
+
+            if (state == LZMA2_STATE_DATA)
+                BeginStoredChunk();
+
+            memcpy(dest, src, size);
+            decoder.SkipUncompressed(size);
+
+            unpackSize -= size;
+            state = (unpackSize == 0) ? LZMA2_STATE_CONTROL : LZMA2_STATE_DATA_CONT;
+            return size;
+        }
+
+        /// Looks at the control byte of the next chunk at src, if the decoder is before one.
+        DicUse NextDicUse(const Byte* src, std::size_t srcSize) const
+        {
+            if (state == LZMA2_STATE_FINISHED)
+                return DicUse::None;
+
+            if (state != LZMA2_STATE_CONTROL || srcSize == 0)
+                return DicUse::Refers;
+
+            if (src[0] == CONTROL_EOF || src[0] == CONTROL_COPY_RESET_DIC || (src[0] & 0xE0) == 0xE0)
+                return DicUse::None;
+
+            return (src[0] == CONTROL_COPY_NO_RESET) ? DicUse::Stored : DicUse::Refers;
+        }
 
     private:
-        Decoder2(const Decoder2&); // = delete;
-        void operator=(const Decoder2&); // = delete;
+        BasicDecoder2(const BasicDecoder2&); // = delete;
+        void operator=(const BasicDecoder2&); // = delete;
 
-        std::unique_ptr<lzma::details::Prob[]> m_probsArr;
+        details::ResourceArray<typename Core::Prob> m_probsArr;
 
         std::size_t packSize;
         std::size_t unpackSize;
@@ -255,10 +665,101 @@ namespace lzma
         bool needInitState;
         bool needInitProp;
 
-        bool isUncompressedState() { return (control & CONTROL_LZMA) == 0; }
+        static const Byte kCheckpointVersion = 2;
+        // the probabilities are saved in the order of m_probsArr, which depends on the traits
+        static const Byte kCheckpointLayout = Byte(sizeof(typename Core::Prob) | (Traits::groupedProbs ? 0x80 : 0));
+
+        bool isUncompressedState() const { return (control & CONTROL_LZMA) == 0; }
 
         unsigned getLzmaMode() { return (control >> 5) & 3; }
 
+        void InitProp(unsigned prop)
+        {
+            decoder.SetLcLpPb(LC_PLUS_LP_MAX, 0, 0);
+            decoder.m_properties.dicSize = (std::uint32_t)GetMemoryNeeds(prop).dicSize;
+            m_stopAtStored = false;
+        }
+
+        void InitProbs()
+        {
+            decoder.m_probs = m_probsArr.get();
+            Reset();
+        }
+
+        void BeginStoredChunk()
+        {
+            auto initDic = (this->control == CONTROL_COPY_RESET_DIC);
+
+            if (initDic)
+            {
+                this->needInitProp = true;
+                this->needInitState = true;
+            }
+            else if (this->needInitDic)
+            {
+                throw BadStream();
+            }
+
+            this->needInitDic = false;
+            this->decoder.InitDicAndState(initDic, false);
+        }
+
+        ELzma2State UpdateProp(unsigned b)
+        {
+            unsigned lc, lp, pb;
+            if (b >= (9 * 5 * 5))
+                return LZMA2_STATE_ERROR;
+            lc = b % 9;
+            b /= 9;
+            pb = b / 5;
+            lp = b % 5;
+
+            if (lc + lp > LC_PLUS_LP_MAX)
+                return LZMA2_STATE_ERROR;
+
+            this->decoder.SetLcLpPb(lc, lp, pb);
+            this->needInitProp = false;
+            return LZMA2_STATE_DATA;
+        }
+
+        /// Does what UpdateState does for all bytes of the chunk header at once.
+        /// There must be kMaxChunkHeaderSize bytes at p. Returns the header size.
+        std::size_t ParseChunkHeader(const Byte* p)
+        {
+            this->control = p[0];
+
+            if (this->control == CONTROL_EOF)
+            {
+                this->state = LZMA2_STATE_FINISHED;
+                return 1;
+            }
+
+            if (isUncompressedState())
+            {
+                if ((this->control & 0x7F) > 2)
+                {
+                    this->state = LZMA2_STATE_ERROR;
+                    return 1;
+                }
+
+                this->unpackSize = (((std::size_t)p[1] << 8) | p[2]) + 1;
+                this->state = LZMA2_STATE_DATA;
+                return 3;
+            }
+
+            this->unpackSize = (((std::size_t)(this->control & 0x1F) << 16) | ((std::size_t)p[1] << 8) | p[2]) + 1;
+            this->packSize = (((std::size_t)p[3] << 8) | p[4]) + 1;
+
+            if (!isThereProp(getLzmaMode()))
+            {
+                this->state = this->needInitProp ? LZMA2_STATE_ERROR : LZMA2_STATE_DATA;
+                return 5;
+            }
+
+            this->state = UpdateProp(p[5]);
+            return 6;
+        }
+
         ELzma2State UpdateState(unsigned b)
         {
             switch (this->state)
@@ -301,23 +802,7 @@ namespace lzma
                 return isThereProp(getLzmaMode()) ? LZMA2_STATE_PROP: (this->needInitProp ? LZMA2_STATE_ERROR : LZMA2_STATE_DATA);
 
             case LZMA2_STATE_PROP:
-                {
-                    int lc, lp;
-                    if (b >= (9 * 5 * 5))
-                        return LZMA2_STATE_ERROR;
-                    lc = b % 9;
-                    b /= 9;
-                    this->decoder.m_properties.pb = b / 5;
-                    lp = b % 5;
-
-                    if (lc + lp > LC_PLUS_LP_MAX)
-                        return LZMA2_STATE_ERROR;
-
-                    this->decoder.m_properties.lc = lc;
-                    this->decoder.m_properties.lp = lp;
-                    this->needInitProp = false;
-                    return LZMA2_STATE_DATA;
-                }
+                return UpdateProp(b);
 
             default:
                 return LZMA2_STATE_ERROR;
@@ -326,16 +811,70 @@ namespace lzma
 
     };
 
-    class BufDecoder2 : private Decoder2
+    /** The internal dictionary is a ring, so Traits::Window must be RingWindow.
+    Stored chunks go straight from src to dest; the dictionary gets only the part of them
+    that a later chunk can refer to, the last dictionary size before an LZMA chunk or the end of the call.
+    Once dest holds everything the matches can refer to (a dictionary size of this call's output, or all
+    of it on the first call), the rest is decoded right into dest, see DecodeInPlace.
+    The ring grows with the output up to the dictionary size, and wraps only then: a stream that
+    decodes to 3 KB doesn't cost a 64 MB dictionary, and one decoded by a single call costs none. */
+    template<typename Traits>
+    class BasicBufDecoder2 : private BasicDecoder2<Traits>
     {
+        static_assert(Traits::Window::wraps, "BufDecoder2 needs a ring dictionary");
+
+        typedef typename BasicDecoder2<Traits>::DicUse DicUse;
+
     public:
-        explicit BufDecoder2(unsigned props) : Decoder2(props)
+        explicit BasicBufDecoder2(unsigned props) : BasicDecoder2<Traits>(props)
         {
-            m_internalDict.reset(new lzma::Byte[decoder.m_properties.dicSize]);
-            decoder.m_dic.mem = m_internalDict.get();
+            Init(kMinDicBufSize, &DefaultMemoryResource());
         }
 
-        using Decoder2::Reset;
+        /// sizeHint - the expected output size: the ring starts at that size, it still grows if the output is longer.
+        BasicBufDecoder2(unsigned props, std::uint64_t sizeHint) : BasicDecoder2<Traits>(props)
+        {
+            Init(sizeHint, &DefaultMemoryResource());
+        }
+
+        /// The probabilities and the ring come from resource, which must outlive the decoder.
+        BasicBufDecoder2(unsigned props, MemoryResource& resource) : BasicDecoder2<Traits>(props, resource)
+        {
+            Init(kMinDicBufSize, &resource);
+        }
+
+        BasicBufDecoder2(unsigned props, std::uint64_t sizeHint, MemoryResource& resource) : BasicDecoder2<Traits>(props, resource)
+        {
+            Init(sizeHint, &resource);
+        }
+
+        /** The caller's memory, which must outlive the decoder: probs as for BasicDecoder2, and dic for the ring.
+        The ring doesn't grow: it uses up to GetMemoryNeeds(props).dicSize bytes, and with fewer DecodeToBuf
+        throws std::length_error once the output since Reset outgrows them. */
+        BasicBufDecoder2(unsigned props, void* probs, std::size_t probsSize, void* dic, std::size_t dicSize)
+            : BasicDecoder2<Traits>(props, probs, probsSize)
+        {
+            Init(kMinDicBufSize, nullptr);
+
+            m_internalDict.Attach(dic, dicSize, dicSize, "dic");
+            this->decoder.m_dic.mem = m_internalDict.get();
+            this->decoder.m_dic.size = std::min<std::size_t>(dicSize, this->decoder.m_properties.dicSize);
+        }
+
+        using BasicDecoder2<Traits>::GetMemoryNeeds;
+
+        using BasicDecoder2<Traits>::Reset;
+        using BasicDecoder2<Traits>::GetStats;
+
+        /// Reset for a stream with another prop byte. The ring is kept: up to the new dictionary size is used right away.
+        void Reset(unsigned prop)
+        {
+            BasicDecoder2<Traits>::Reset(prop);
+            this->decoder.m_dic.size = std::min<std::size_t>(m_internalDict.size(), this->decoder.m_properties.dicSize);
+        }
+
+        /// The size of the ring so far, it is allocated on the first call that needs it.
+        std::size_t GetDicBufSize() const { return this->decoder.m_dic.size; }
 
         void DecodeToBuf(void* dest, std::size_t& destLen, const void* src, std::size_t& srcLen, FinishMode finishMode, Status& status)
         {
@@ -345,14 +884,71 @@ namespace lzma
             auto inSize = srcLen;
             srcLen = 0;
             destLen = 0;
+
+            // stored bytes in dest that are not in the dictionary yet, they end at m_dic.pos
+            auto stored = destBytes;
+            std::size_t storedSize = 0;
+
+            auto inPlace = this->BeforeFirstChunk();
+
             for (;;)
             {
                 auto srcSizeCur = inSize;
-                
+
+                // before the ring is touched: it may not be needed at all
+                if (outSize != 0 && (inPlace || destLen >= this->decoder.m_properties.dicSize))
+                {
+                    auto size = DecodeInPlace(destBytes - destLen, destLen, destLen + outSize,
+                        storedSize != 0 ? stored : destBytes, srcBytes, srcSizeCur, inSize, finishMode, status);
+
+                    srcLen += srcSizeCur;
+                    destLen += size;
+                    return;
+                }
+
+                if (this->decoder.m_dic.pos == this->decoder.m_dic.size)
+                    ReserveDic(this->decoder.m_dic.size + 1);
+
                 if (this->decoder.m_dic.pos == this->decoder.m_dic.size)
                     this->decoder.m_dic.pos = 0;
 
                 auto dicPos = this->decoder.m_dic.pos;
+
+                if (this->AtStoredData())
+                {
+                    auto size = this->CopyStored(destBytes, std::min(outSize, this->decoder.m_dic.size - dicPos), srcBytes, inSize);
+                    if (size == 0)
+                    {
+                        if (outSize == 0 && finishMode == FinishMode::End)
+                            throw BadStream();
+
+                        status = (outSize == 0) ? Status::NotFinished : Status::NeedsMoreInput;
+                        break;
+                    }
+
+                    if (storedSize == 0)
+                        stored = destBytes;
+                    storedSize += size;
+
+                    srcBytes += size;
+                    inSize -= size;
+                    srcLen += size;
+                    destBytes += size;
+                    outSize -= size;
+                    destLen += size;
+                    continue;
+                }
+
+                if (storedSize != 0)
+                {
+                    auto use = this->NextDicUse(srcBytes, inSize);
+                    if (use != DicUse::Stored)
+                    {
+                        if (use == DicUse::Refers)
+                            StoreTail(stored, storedSize);
+                        storedSize = 0;
+                    }
+                }
                 
                 std::size_t outSizeCur;
                 FinishMode curFinishMode;
@@ -367,7 +963,7 @@ namespace lzma
                     curFinishMode = finishMode;
                 }
 
-                DecodeToDic(outSizeCur, srcBytes, srcSizeCur, curFinishMode, status);
+                this->DecodeToDic(outSizeCur, srcBytes, srcSizeCur, curFinishMode, status);
                 srcBytes += srcSizeCur;
                 inSize -= srcSizeCur;
                 srcLen += srcSizeCur;
@@ -377,18 +973,331 @@ namespace lzma
                 outSize -= outSizeCur;
                 destLen += outSizeCur;
 
-                if (outSizeCur == 0 || outSize == 0)
-                    return;
+                // DecodeToDic stops with no output at the data of a stored chunk
+                if ((outSizeCur == 0 && !this->AtStoredData()) || outSize == 0)
+                    break;
             }
+
+            // dest is the caller's again after the return
+            if (storedSize != 0 && this->NextDicUse(srcBytes, inSize) != DicUse::None)
+                StoreTail(stored, storedSize);
         }
     private:
-        BufDecoder2(const BufDecoder2&); // = delete;
-        void operator=(const BufDecoder2&); // = delete;
+        BasicBufDecoder2(const BasicBufDecoder2&); // = delete;
+        void operator=(const BasicBufDecoder2&); // = delete;
+
+        static const std::size_t kMinDicBufSize = 1 << 12;
+
+        details::ResourceArray<lzma::Byte> m_internalDict;
+        MemoryResource* m_dicResource; ///< null if the ring is the caller's
+        std::size_t m_dicBufHint;      ///< the first size of the ring
+
+        void Init(std::uint64_t sizeHint, MemoryResource* resource)
+        {
+            m_dicResource = resource;
+            // not more than the largest dictionary: the hint outlasts Reset(prop)
+            m_dicBufHint = (std::size_t)std::min<std::uint64_t>(std::max<std::uint64_t>(sizeHint, 1), 0xFFFFFFFF);
+
+            this->decoder.m_dic.mem = nullptr;
+            this->decoder.m_dic.size = 0;
+            this->m_stopAtStored = true;
+        }
+
+        /** Grows the ring to at least size bytes, or to the dictionary size if that is less.
+        Before it has the dictionary size the ring hasn't wrapped: the output since Reset is at its start,
+        before m_dic.pos, and stays there. */
+        void ReserveDic(std::size_t size)
+        {
+            auto& dic = this->decoder.m_dic;
+            std::size_t dicSize = this->decoder.m_properties.dicSize;
+            if (size <= dic.size || dic.size == dicSize)
+                return;
+
+            // after Reset(prop) the ring can be longer than m_dic.size
+            if (m_internalDict.size() > dic.size)
+            {
+                dic.size = std::min<std::size_t>(m_internalDict.size(), dicSize);
+                if (size <= dic.size || dic.size == dicSize)
+                    return;
+            }
+
+            if (m_dicResource == nullptr)
+                throw std::length_error("dic");
+
+            auto newSize = std::max(std::max(size, m_dicBufHint), (dic.size > dicSize / 2) ? dicSize : dic.size * 2);
+            newSize = std::min(newSize, dicSize);
+
+            details::ResourceArray<lzma::Byte> mem;
+            mem.Allocate(*m_dicResource, newSize);
+            if (dic.pos != 0)
+                memcpy(mem.get(), dic.mem, dic.pos);
+
+            m_internalDict.swap(mem);
+            dic.mem = m_internalDict.get();
+            dic.size = newSize;
+        }
+
+        /** Decodes into dest as the window: the done bytes before dest + done are the output of this call and
+        hold every byte the matches can refer to. Then, if a later chunk can refer to them, moves m_dic.pos as far as
+        the output and writes the bytes from tailStart (the stored ones not in the ring yet and the output) to the ring,
+        growing it as needed. Returns the output size. */
+        std::size_t DecodeInPlace(lzma::Byte* dest, std::size_t done, std::size_t destSize, const lzma::Byte* tailStart,
+            const lzma::Byte* src, std::size_t& srcLen, std::size_t inSize, FinishMode finishMode, Status& status)
+        {
+            auto& dic = this->decoder.m_dic;
+            auto ring = dic;
+            dic.mem = dest;
+            dic.size = destSize;
+            dic.pos = done;
+            this->m_stopAtStored = false;
+
+            try
+            {
+                this->DecodeToDic(destSize, src, srcLen, finishMode, status);
+            }
+            catch (...)
+            {
+                dic = ring;
+                this->m_stopAtStored = true;
+                throw;
+            }
+
+            auto end = dic.pos;
+            dic = ring;
+            this->m_stopAtStored = true;
+
+            // the ring and m_dic.pos are left as they are: the next chunk doesn't refer to what is before it
+            if (this->NextDicUse(src + srcLen, inSize - srcLen) == DicUse::None)
+                return end - done;
+
+            // past the end only once the ring has the dictionary size, at the end the next call grows it or wraps
+            auto pos = dic.pos + (end - done);
+            ReserveDic(pos);
+            dic.pos = (pos > dic.size) ? pos % dic.size : pos;
+            StoreTail(tailStart, dest + end - tailStart);
+
+            return end - done;
+        }
+
+        /// Writes the last dictionary size of the size bytes at data to the dictionary, where they end at m_dic.pos.
+        void StoreTail(const lzma::Byte* data, std::size_t size)
+        {
+            auto& dic = this->decoder.m_dic;
+            auto tail = std::min(size, dic.size);
+            if (tail == 0)
+                return;
+
+            data += size - tail;
+
+            auto start = (dic.pos >= tail) ? dic.pos - tail : dic.pos + dic.size - tail;
+            auto first = std::min(tail, dic.size - start);
+            memcpy(dic.mem + start, data, first);
+            memcpy(dic.mem, data + first, tail - first);
+        }
+    };
+
+    typedef BasicDecoder2<DefaultTraits> Decoder2;
+    typedef BasicBufDecoder2<DefaultTraits> BufDecoder2;
+
+    /// 32-bit probabilities, as in the original LZMA SDK. Uses twice as much memory for the same output.
+    struct Prob32Traits : DefaultTraits
+    {
+        typedef std::uint32_t Prob;
+    };
+
+    typedef BasicDecoder2<Prob32Traits> Decoder2Prob32;
+    typedef BasicBufDecoder2<Prob32Traits> BufDecoder2Prob32;
+
+    /// The dictionary is the caller's buffer for the whole output, as in Lzma2Decode.
+    struct LinearTraits : DefaultTraits
+    {
+        typedef LinearWindow Window;
+    };
+
+    typedef BasicDecoder2<LinearTraits> LinearDecoder2;
+
+    /// 64-bit range coder registers with 4-byte input refills.
+    struct WideRcTraits : DefaultTraits
+    {
+        static const bool wideRangeCoder = true;
+    };
+
+    typedef BasicDecoder2<WideRcTraits> Decoder2WideRc;
+    typedef BasicBufDecoder2<WideRcTraits> BufDecoder2WideRc;
+
+    /// Software prefetching, for streams with large dictionaries.
+    struct PrefetchTraits : DefaultTraits
+    {
+        static const bool prefetch = true;
+    };
+
+    typedef BasicDecoder2<PrefetchTraits> Decoder2Prefetch;
+    typedef BasicBufDecoder2<PrefetchTraits> BufDecoder2Prefetch;
+
+    /// Counts the decoded symbols, see SymbolStats.
+    struct StatsTraits : DefaultTraits
+    {
+        typedef SymbolStats Stats;
+    };
+
+    typedef BasicDecoder2<StatsTraits> Decoder2Stats;
+    typedef BasicBufDecoder2<StatsTraits> BufDecoder2Stats;
 
-        std::unique_ptr<lzma::Byte[]> m_internalDict;
+    /// Bit trees without branches on the decoded bits, for poorly compressible data.
+    struct BranchlessTraits : DefaultTraits
+    {
+        static const bool branchlessTrees = true;
+    };
+
+    typedef BasicDecoder2<BranchlessTraits> Decoder2Branchless;
+    typedef BasicBufDecoder2<BranchlessTraits> BufDecoder2Branchless;
+
+    /// The per-state probabilities of a state share cache lines.
+    struct GroupedProbsTraits : DefaultTraits
+    {
+        static const bool groupedProbs = true;
     };
+
+    typedef BasicDecoder2<GroupedProbsTraits> Decoder2GroupedProbs;
+    typedef BasicBufDecoder2<GroupedProbsTraits> BufDecoder2GroupedProbs;
+
+    /* ---------- Chunk index ---------- */
+
+    enum class ChunkType
+    {
+        Stored, ///< uncompressed data
+        Lzma    ///< LZMA data
+    };
+
+    /// An LZMA2 chunk, as found by ScanChunks.
+    struct ChunkInfo
+    {
+        std::uint64_t packedOffset;   ///< offset of the chunk header in the stream
+        std::uint64_t unpackedOffset; ///< offset of the first byte of the chunk in the output
+        std::uint32_t packedSize;     ///< header and data
+        std::uint32_t unpackedSize;
+        ChunkType type;
+        bool resetsDic;   ///< decoding can start here, it doesn't refer to earlier data
+        bool resetsState;
+        bool setsProps;
+        std::uint8_t props; ///< lc, lp and pb of the chunk, also when it doesn't set them
+    };
+
+    struct ChunkIndex
+    {
+        std::vector<ChunkInfo> chunks;
+        std::uint64_t packedSize;   ///< the whole stream, with the end byte
+        std::uint64_t unpackedSize; ///< exact size of the output
+    };
+
+    /** Lists the chunks of an LZMA2 stream without decoding them: reads the chunk headers
+    and skips the data. Throws BadStream if the stream is invalid or doesn't end in srcLen bytes.
+    The data of LZMA chunks is not checked, the decoder may still find it bad. */
+    inline ChunkIndex ScanChunks(const void* src, std::size_t srcLen)
+    {
+        typedef details::Decoder2Base Base;
+
+        auto bytes = static_cast<const Byte*>(src);
+        ChunkIndex index;
+        index.unpackedSize = 0;
+
+        std::size_t pos = 0;
+        unsigned props = 0;
+        // the same rules as in Decoder2: a dictionary reset by a stored chunk needs new props and state
+        auto needDic = true, needProps = true, needState = true;
+        for (;;)
+        {
+            if (pos == srcLen)
+                throw BadStream(); // no end byte
+
+            unsigned control = bytes[pos];
+            if (control == Base::CONTROL_EOF)
+                break;
+
+            ChunkInfo chunk;
+            chunk.packedOffset = pos;
+            chunk.unpackedOffset = index.unpackedSize;
+
+            std::size_t headerSize, dataSize;
+            if ((control & Base::CONTROL_LZMA) == 0)
+            {
+                if (control > Base::CONTROL_COPY_NO_RESET)
+                    throw BadStream();
+
+                headerSize = 3;
+                if (srcLen - pos < headerSize)
+                    throw BadStream();
+
+                chunk.unpackedSize = (((std::uint32_t)bytes[pos + 1] << 8) | bytes[pos + 2]) + 1;
+                dataSize = chunk.unpackedSize;
+                chunk.type = ChunkType::Stored;
+                chunk.resetsDic = (control == Base::CONTROL_COPY_RESET_DIC);
+                chunk.resetsState = false;
+                chunk.setsProps = false;
+
+                if (chunk.resetsDic)
+                    needProps = needState = true;
+            }
+            else
+            {
+                auto mode = (control >> 5) & 3;
+                headerSize = Base::isThereProp(mode) ? 6 : 5;
+                if (srcLen - pos < headerSize)
+                    throw BadStream();
+
+                chunk.unpackedSize = (((std::uint32_t)(control & 0x1F) << 16) | ((std::uint32_t)bytes[pos + 1] << 8) | bytes[pos + 2]) + 1;
+                dataSize = (((std::size_t)bytes[pos + 3] << 8) | bytes[pos + 4]) + 1;
+                chunk.type = ChunkType::Lzma;
+                chunk.resetsDic = (mode == 3);
+                chunk.resetsState = (mode > 0);
+                chunk.setsProps = Base::isThereProp(mode);
+
+                if (chunk.setsProps)
+                {
+                    props = bytes[pos + 5];
+                    if (props >= 9 * 5 * 5 || props % 9 + props / 9 % 5 > Base::LC_PLUS_LP_MAX)
+                        throw BadStream();
+                }
+                else if (needProps)
+                {
+                    throw BadStream();
+                }
+
+                if (needState && !chunk.resetsState)
+                    throw BadStream();
+
+                needProps = needState = false;
+            }
+
+            if (needDic && !chunk.resetsDic)
+                throw BadStream();
+
+            needDic = false;
+
+            if (srcLen - pos - headerSize < dataSize)
+                throw BadStream();
+
+            chunk.props = (std::uint8_t)props;
+            chunk.packedSize = (std::uint32_t)(headerSize + dataSize);
+            pos += chunk.packedSize;
+            index.unpackedSize += chunk.unpackedSize;
+            index.chunks.push_back(chunk);
+        }
+
+        index.packedSize = pos + 1;
+        return index;
+    }
+
     /* ---------- One Call Interface ---------- */
 
+    /// Input block with the number of readable bytes after it.
+    struct InputSpan
+    {
+        const void* data;
+        std::size_t size;
+        std::size_t padding; ///< readable bytes after data + size, use InputPaddingSize or more for the fast mode
+    };
+
     /**
     finishMode:
         It has meaning only if the decoding reaches output limit (*destLen).
@@ -399,23 +1308,130 @@ namespace lzma
         LZMA_STATUS_FINISHED_WITH_MARK
         LZMA_STATUS_NOT_FINISHED
     */
-    inline bool Lzma2Decode(void* dest, std::size_t& destLen, const void* src, std::size_t& srcLen, unsigned prop, FinishMode finishMode, Status& status)
+    inline bool Lzma2Decode(void* dest, std::size_t& destLen, InputSpan src, std::size_t& srcLen, unsigned prop, FinishMode finishMode, Status& status)
     {
         auto destBytes = static_cast<lzma::Byte*>(dest);
         auto outSize = destLen;
-        auto inSize = srcLen;
+        auto inSize = src.size;
 
         destLen = 0;
         srcLen = 0;
         
-        Decoder2 decoder(prop);
+        LinearDecoder2 decoder(prop);
         decoder.decoder.m_dic.mem = destBytes;
         decoder.decoder.m_dic.size = outSize;
 
         srcLen = inSize;
-        decoder.DecodeToDic(outSize, src, srcLen, finishMode, status);
+        auto slack = (src.padding >= InputPaddingSize) ? InputSlack::Padded : InputSlack::None;
+        decoder.DecodeToDic(outSize, src.data, srcLen, finishMode, status, slack);
         destLen = decoder.decoder.m_dic.pos;
         
         return status != Status::NeedsMoreInput;;
     }
+
+    /// srcLen bytes of the input are used, see InputSpan to let the decoder read ahead.
+    inline bool Lzma2Decode(void* dest, std::size_t& destLen, const void* src, std::size_t& srcLen, unsigned prop, FinishMode finishMode, Status& status)
+    {
+        InputSpan input = { src, srcLen, 0 };
+        return Lzma2Decode(dest, destLen, input, srcLen, prop, finishMode, status);
+    }
+
+    /* ---------- Random access ---------- */
+
+    namespace details
+    {
+        /** Decodes skip + length bytes of output with a decoder whose dictionary is a ring: the first skip bytes
+        stay in the ring, the rest is copied to dest. src and inSize are moved past the input used.
+        Throws BadStream if the stream ends first. */
+        template<typename Decoder>
+        void DecodeThroughRing(Decoder& decoder, const Byte*& src, std::size_t& inSize, std::uint64_t skip, Byte* dest, std::size_t length)
+        {
+            auto& dic = decoder.decoder.m_dic;
+            std::size_t written = 0;
+
+            while (skip != 0 || written != length)
+            {
+                if (dic.pos == dic.size)
+                    dic.pos = 0;
+
+                auto dicPos = dic.pos;
+                auto wanted = (skip != 0) ? skip : length - written;
+                auto dicLimit = dicPos + (std::size_t)std::min<std::uint64_t>(wanted, dic.size - dicPos);
+
+                auto srcLen = inSize;
+                Status status;
+                decoder.DecodeToDic(dicLimit, src, srcLen, FinishMode::Any, status);
+                src += srcLen;
+                inSize -= srcLen;
+
+                auto decoded = dic.pos - dicPos;
+                if (decoded == 0)
+                    throw BadStream(); // the stream is shorter than its chunk headers say
+
+                if (skip != 0)
+                {
+                    skip -= decoded;
+                }
+                else
+                {
+                    memcpy(dest + written, dic.mem + dicPos, decoded);
+                    written += decoded;
+                }
+            }
+        }
+
+        /// The last dictionary reset at or before offset, which must be in the stream.
+        inline const ChunkInfo& LastDicReset(const ChunkIndex& index, std::uint64_t offset)
+        {
+            auto& chunks = index.chunks;
+            auto chunk = std::upper_bound(chunks.begin(), chunks.end(), offset,
+                [](std::uint64_t pos, const ChunkInfo& c) { return pos < c.unpackedOffset; }) - 1;
+            while (!chunk->resetsDic)
+                --chunk;
+
+            return *chunk;
+        }
+    }
+
+    /**
+    Decodes length bytes of the output of a complete LZMA2 stream, starting at offset, to dest.
+
+    Decoding starts at the last dictionary reset before offset, and the bytes before offset only pass
+    through a ring dictionary, so a call takes time in proportion to the distance between the dictionary
+    resets of the stream, not to offset. See Lzma2Checkpoints.hpp for streams without resets.
+
+    index - ScanChunks(src, srcLen), made once for many calls.
+    Returns the number of bytes written, less than length if the stream ends before offset + length.
+    Throws BadStream if the stream is invalid.
+    */
+    inline std::size_t Lzma2DecodeRange(void* dest, std::uint64_t offset, std::size_t length,
+        const void* src, std::size_t srcLen, unsigned prop, const ChunkIndex& index)
+    {
+        if (offset >= index.unpackedSize)
+            return 0;
+
+        length = (std::size_t)std::min<std::uint64_t>(length, index.unpackedSize - offset);
+        if (length == 0)
+            return 0;
+
+        auto& first = details::LastDicReset(index, offset);
+
+        Decoder2 decoder(prop);
+        auto dicSize = (std::size_t)std::min<std::uint64_t>(decoder.decoder.m_properties.dicSize, offset + length - first.unpackedOffset);
+        std::unique_ptr<Byte[]> dic(new Byte[dicSize]);
+        decoder.decoder.m_dic.mem = dic.get();
+        decoder.decoder.m_dic.size = dicSize;
+
+        auto srcBytes = static_cast<const Byte*>(src) + first.packedOffset;
+        auto inSize = srcLen - (std::size_t)first.packedOffset;
+        details::DecodeThroughRing(decoder, srcBytes, inSize, offset - first.unpackedOffset, static_cast<Byte*>(dest), length);
+        return length;
+    }
+
+    /// Lzma2DecodeRange for a single call: indexes the stream first.
+    inline std::size_t Lzma2DecodeRange(void* dest, std::uint64_t offset, std::size_t length,
+        const void* src, std::size_t srcLen, unsigned prop)
+    {
+        return Lzma2DecodeRange(dest, offset, length, src, srcLen, prop, ScanChunks(src, srcLen));
+    }
 }
@@ -0,0 +1,102 @@
+// C++ LZMA2 Decoder
+// Pools of decoders kept for reuse
+// Placed in the public domain
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "Lzma2Decoder.hpp"
+
+namespace lzma
+{
+    /**
+    Decoders given back for reuse, by dictionary size class: a decoder from the pool keeps its
+    probabilities, and a BufDecoder2 its ring, which has already grown to the output of streams
+    with a similar dictionary. So decoding in a steady state neither allocates nor touches new pages.
+
+    A pool must outlive its handles, and is not thread-safe, see ThreadLocal.
+    Decoder is BasicDecoder2 or BasicBufDecoder2.
+    */
+    template<typename Decoder>
+    class DecoderPool
+    {
+    public:
+        /// Gives the decoder back to the pool it came from.
+        struct Return
+        {
+            DecoderPool* pool;
+            unsigned sizeClass;
+
+            void operator()(Decoder* decoder) const { pool->Release(decoder, sizeClass); }
+        };
+
+        typedef std::unique_ptr<Decoder, Return> Handle;
+
+        /// maxPerClass - how many decoders of a size class the pool keeps, the others are deleted when they are given back.
+        explicit DecoderPool(std::size_t maxPerClass = 4) : m_maxPerClass(maxPerClass) {}
+
+        /** A decoder Reset for prop: the last one given back with the same dictionary size class, or a new one.
+        A Decoder2 needs its m_dic set, as after construction. Throws std::invalid_argument if prop is invalid. */
+        Handle Acquire(unsigned prop)
+        {
+            auto sizeClass = SizeClass(Decoder::GetMemoryNeeds(prop).dicSize);
+            Return giveBack = { this, sizeClass };
+
+            auto& decoders = m_free[sizeClass];
+            if (decoders.empty())
+                return Handle(new Decoder(prop), giveBack);
+
+            std::unique_ptr<Decoder> decoder(std::move(decoders.back()));
+            decoders.pop_back();
+            decoder->Reset(prop);
+            return Handle(decoder.release(), giveBack);
+        }
+
+        /// Decoders in the pool, not handed out.
+        std::size_t Size() const
+        {
+            std::size_t size = 0;
+            for (auto& decoders : m_free)
+                size += decoders.size();
+            return size;
+        }
+
+#if defined(LZMA_HAS_THREAD_LOCAL)
+        /** The pool of the calling thread, so there is no locking. Its handles must be given back
+        on this thread, before it ends. Not with VC++2013, see LZMA_HAS_THREAD_LOCAL. */
+        static DecoderPool& ThreadLocal()
+        {
+            static thread_local DecoderPool pool;
+            return pool;
+        }
+#endif
+
+    private:
+        DecoderPool(const DecoderPool&); // = delete;
+        void operator=(const DecoderPool&); // = delete;
+
+        // floor(log2(dicSize)) - 12: 4 KB and 6 KB dictionaries are class 0, 3 GB and 4 GB class 19
+        static const unsigned kNumSizeClasses = 20;
+
+        std::size_t m_maxPerClass;
+        std::vector<std::unique_ptr<Decoder>> m_free[kNumSizeClasses];
+
+        static unsigned SizeClass(std::size_t dicSize)
+        {
+            unsigned sizeClass = 0;
+            while (sizeClass + 1 < kNumSizeClasses && (dicSize >> (sizeClass + 13)) != 0)
+                ++sizeClass;
+            return sizeClass;
+        }
+
+        void Release(Decoder* decoder, unsigned sizeClass)
+        {
+            std::unique_ptr<Decoder> owned(decoder);
+            if (m_free[sizeClass].size() < m_maxPerClass)
+                m_free[sizeClass].push_back(std::move(owned));
+        }
+    };
+}
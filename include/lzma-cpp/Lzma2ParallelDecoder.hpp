@@ -0,0 +1,411 @@
+// C++ LZMA2 Decoder
+// Parallel decoding of LZMA2 streams at dictionary and state resets
+// Placed in the public domain
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "Lzma2Decoder.hpp"
+
+namespace lzma
+{
+    /// A run of chunks, see SplitAtDicResets and SplitAtStateResets.
+    struct Segment
+    {
+        std::size_t firstChunk;
+        std::size_t numChunks;
+    };
+
+    namespace details
+    {
+        template<typename StartsSegment>
+        std::vector<Segment> SplitChunks(const ChunkIndex& index, StartsSegment startsSegment)
+        {
+            std::vector<Segment> segments;
+            for (std::size_t i = 0; i != index.chunks.size(); ++i)
+            {
+                if (startsSegment(index.chunks[i]))
+                {
+                    Segment segment = { i, 0 };
+                    segments.push_back(segment);
+                }
+
+                segments.back().numChunks++;
+            }
+
+            return segments;
+        }
+    }
+
+    /// Splits a stream at its dictionary resets. A segment decodes without the data before it.
+    inline std::vector<Segment> SplitAtDicResets(const ChunkIndex& index)
+    {
+        return details::SplitChunks(index, [](const ChunkInfo& chunk) { return chunk.resetsDic; });
+    }
+
+    /// Splits a stream at its dictionary and state resets. A segment decodes with new probabilities,
+    /// but its matches and literals may still depend on the data before it.
+    inline std::vector<Segment> SplitAtStateResets(const ChunkIndex& index)
+    {
+        return details::SplitChunks(index, [](const ChunkInfo& chunk)
+        {
+            return chunk.resetsDic || (chunk.type == ChunkType::Lzma && chunk.resetsState);
+        });
+    }
+
+    namespace details
+    {
+        /** Decodes a segment of the stream at src to dic + dicPos.
+        processed - bytes decoded since the last dictionary reset, the dictionary must hold them before dicPos
+        (or as many as the dictionary size). Bytes of the stream after the segment let the decoder run its
+        fast loop up to the segment end. */
+        template<typename Decoder>
+        void DecodeSegment(Decoder& decoder, Byte* dic, std::size_t dicPos, std::uint64_t processed,
+            const Byte* src, std::size_t srcLen, const ChunkIndex& index, Segment segment)
+        {
+            auto& first = index.chunks[segment.firstChunk];
+            auto& last = index.chunks[segment.firstChunk + segment.numChunks - 1];
+            auto packedOffset = (std::size_t)first.packedOffset;
+            auto packedSize = (std::size_t)(last.packedOffset + last.packedSize - first.packedOffset);
+            auto unpackedSize = (std::size_t)(last.unpackedOffset + last.unpackedSize - first.unpackedOffset);
+
+            if (processed != 0)
+                decoder.ResumeAt(processed, first.props);
+
+            decoder.decoder.m_dic.mem = dic;
+            decoder.decoder.m_dic.pos = dicPos;
+            decoder.decoder.m_dic.size = dicPos + unpackedSize;
+
+            auto slack = (srcLen - packedOffset - packedSize >= InputPaddingSize) ? InputSlack::Padded : InputSlack::None;
+            auto inSize = packedSize;
+            Status status;
+            decoder.DecodeToDic(dicPos + unpackedSize, src + packedOffset, inSize, FinishMode::Any, status, slack);
+
+            if (decoder.decoder.m_dic.pos != dicPos + unpackedSize || inSize != packedSize)
+                throw BadStream();
+        }
+
+        /// Calls f(i) for i in [0, count) on up to numThreads threads (0 - one per core), the calling thread included.
+        /// The threads take i in order. The first exception stops the others and is rethrown.
+        template<typename F>
+        void ParallelFor(std::size_t count, unsigned numThreads, F f)
+        {
+            if (numThreads == 0)
+                numThreads = std::max(1u, std::thread::hardware_concurrency());
+            numThreads = (unsigned)std::min<std::size_t>(numThreads, count);
+
+            std::atomic<std::size_t> next(0);
+            std::vector<std::exception_ptr> errors(numThreads);
+
+            auto work = [&](unsigned thread)
+            {
+                try
+                {
+                    for (std::size_t i; (i = next++) < count; )
+                        f(i);
+                }
+                catch (...)
+                {
+                    errors[thread] = std::current_exception();
+                    next = count;
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (auto i = 1u; i < numThreads; ++i)
+            {
+                try
+                {
+                    threads.emplace_back(work, i);
+                }
+                catch (std::system_error&)
+                {
+                    break; // go on with the threads we have
+                }
+            }
+
+            if (numThreads != 0)
+                work(0);
+
+            for (auto& thread : threads)
+                thread.join();
+
+            for (auto& error : errors)
+            {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        }
+
+        /// Thrown by GuessTracker when a literal depends on a guessed byte: the segment can't be decoded ahead.
+        struct GuessMissed {};
+
+        /** Traits::Tracker of a speculative decoding. The dictionary bytes before start are guesses but for
+        the known ranges (the stored chunks there), and so are the bytes copied from them. The tracker records
+        those copies, to redo them once the real bytes are known. A literal whose probabilities a guessed
+        byte would pick, or a copy from before the dictionary, throws GuessMissed. */
+        struct GuessTracker
+        {
+            struct Copy { std::size_t dest, src, len; };
+            struct Range { std::size_t begin, end; };
+
+            std::size_t start;
+            std::size_t end;          ///< the dictionary size: positions before 0 wrap around past it
+            std::vector<Range> known; ///< by position, before start
+            std::vector<Copy> copies; ///< by dest, the guessed bytes after start
+
+            GuessTracker() : start(0), end(0) {}
+
+            void OnRead(std::size_t pos, unsigned mask)
+            {
+                if (mask != 0 && IsGuessed(pos, 1))
+                    throw GuessMissed();
+            }
+
+            void OnCopy(std::size_t dest, std::size_t src, std::size_t len)
+            {
+                if (src >= end)
+                    throw GuessMissed();
+
+                // an overlapping copy repeats the bytes before dest
+                if (len != 0 && IsGuessed(src, std::min(len, dest - src)))
+                {
+                    Copy copy = { dest, src, len };
+                    copies.push_back(copy);
+                }
+            }
+
+        private:
+            bool IsGuessed(std::size_t pos, std::size_t len) const
+            {
+                if (pos >= end)
+                    return true;
+
+                if (pos < start)
+                {
+                    // the last known range that begins at or before pos
+                    auto it = std::upper_bound(known.begin(), known.end(), pos,
+                        [](std::size_t p, const Range& range) { return p < range.begin; });
+                    return it == known.begin() || pos + len > (--it)->end;
+                }
+
+                if (copies.empty() || pos >= copies.back().dest + copies.back().len)
+                    return false; // the usual case: after the last guessed bytes
+
+                // the first copy that ends after pos, the copies don't overlap
+                auto it = std::upper_bound(copies.begin(), copies.end(), pos,
+                    [](std::size_t p, const Copy& copy) { return p < copy.dest + copy.len; });
+                return it != copies.end() && it->dest < pos + len;
+            }
+        };
+
+        struct SpeculativeTraits : LinearTraits
+        {
+            typedef GuessTracker Tracker;
+        };
+    }
+
+    /**
+    Decodes a complete LZMA2 stream on up to numThreads threads, 0 means one per core.
+    The stream is split at its dictionary resets, see SplitAtDicResets, and each segment is decoded
+    straight to its place in dest. A stream without resets decodes on the calling thread only.
+
+    destLen: in - the size of dest, out - the decoded size.
+    srcLen: in - the input size, out - the size of the stream with its end byte.
+
+    Throws BadStream if the stream is invalid or incomplete, std::invalid_argument if it doesn't fit in dest.
+    */
+    inline void Lzma2DecodeParallel(void* dest, std::size_t& destLen, const void* src, std::size_t& srcLen, unsigned prop,
+        unsigned numThreads = 0)
+    {
+        if (prop > 40)
+            throw std::invalid_argument("prop");
+
+        auto destBytes = static_cast<Byte*>(dest);
+        auto srcBytes = static_cast<const Byte*>(src);
+
+        auto index = ScanChunks(src, srcLen);
+        if (index.unpackedSize > destLen)
+            throw std::invalid_argument("destLen");
+
+        auto segments = SplitAtDicResets(index);
+
+        // the threads take the segments in order, so the work stays balanced when their sizes differ
+        details::ParallelFor(segments.size(), numThreads, [&](std::size_t i)
+        {
+            LinearDecoder2 decoder(prop);
+            details::DecodeSegment(decoder, destBytes + index.chunks[segments[i].firstChunk].unpackedOffset, 0, 0,
+                srcBytes, srcLen, index, segments[i]);
+        });
+
+        destLen = (std::size_t)index.unpackedSize;
+        srcLen = (std::size_t)index.packedSize;
+    }
+
+    /**
+    Decodes a complete LZMA2 stream on up to numThreads threads (0 - one per core), like Lzma2DecodeParallel,
+    but splits it at state resets too, see SplitAtStateResets.
+
+    Each segment after a state reset is decoded in two phases:
+    1. In parallel, with guesses for the dictionary before the segment: zeros, and the stored chunks
+       there, which are known from the input. The guesses reach back as far as the segment is long.
+       The copies of guessed bytes are recorded. A literal whose probabilities a guessed byte would pick,
+       or a match from beyond the guesses, stops the decoding: the speculation has missed.
+    2. In order, when the data before the segment is final: the recorded copies are done again from the
+       real bytes, and the segments which missed are decoded on the calling thread.
+
+    Speculation pays off only when the decoding of a segment doesn't depend on the unknown data before it.
+    With lc > 0 the first literal already reads the byte before the segment, so it hits only after a
+    stored chunk, where xz resets the state (the SDK encoder doesn't). Other segments with lc > 0 aren't
+    decoded ahead at all, they go to phase 2 right away. A segment stops at its first literal after
+    a match into the guesses. Segments after dictionary resets never miss.
+
+    destLen, srcLen and the exceptions are as in Lzma2DecodeParallel.
+    Returns the number of segments decoded in phase 2.
+    */
+    inline std::size_t Lzma2DecodeSpeculative(void* dest, std::size_t& destLen, const void* src, std::size_t& srcLen, unsigned prop,
+        unsigned numThreads = 0)
+    {
+        typedef BasicDecoder2<details::SpeculativeTraits> SpeculativeDecoder;
+        typedef details::GuessTracker::Copy Copy;
+        typedef details::GuessTracker::Range Range;
+
+        if (prop > 40)
+            throw std::invalid_argument("prop");
+
+        auto destBytes = static_cast<Byte*>(dest);
+        auto srcBytes = static_cast<const Byte*>(src);
+
+        auto index = ScanChunks(src, srcLen);
+        if (index.unpackedSize > destLen)
+            throw std::invalid_argument("destLen");
+
+        auto segments = SplitAtStateResets(index);
+
+        // bytes decoded since the last dictionary reset, at the start of each segment
+        std::vector<std::uint64_t> processed(segments.size());
+        std::uint64_t dicStart = 0;
+        for (std::size_t i = 0; i != segments.size(); ++i)
+        {
+            auto& first = index.chunks[segments[i].firstChunk];
+            if (first.resetsDic)
+                dicStart = first.unpackedOffset;
+
+            processed[i] = first.unpackedOffset - dicStart;
+        }
+
+        struct Speculation
+        {
+            std::vector<Copy> copies;
+            bool missed;
+        };
+        std::vector<Speculation> speculations(segments.size());
+
+        details::ParallelFor(segments.size(), numThreads, [&](std::size_t i)
+        {
+            auto& first = index.chunks[segments[i].firstChunk];
+            auto out = destBytes + first.unpackedOffset;
+
+            speculations[i].missed = false;
+            if (processed[i] == 0)
+            {
+                LinearDecoder2 decoder(prop);
+                details::DecodeSegment(decoder, out, 0, 0, srcBytes, srcLen, index, segments[i]);
+                return;
+            }
+
+            // with lc > 0 the first literal would read a guess, unless a stored chunk ends right before the segment
+            if (first.props % 9 != 0 && index.chunks[segments[i].firstChunk - 1].type != ChunkType::Stored)
+            {
+                speculations[i].missed = true;
+                return;
+            }
+
+            SpeculativeDecoder decoder(prop);
+
+            auto& last = index.chunks[segments[i].firstChunk + segments[i].numChunks - 1];
+            auto unpackedSize = (std::size_t)(last.unpackedOffset + last.unpackedSize - first.unpackedOffset);
+            auto window = (std::size_t)std::min<std::uint64_t>(std::min<std::uint64_t>(processed[i], decoder.decoder.m_properties.dicSize),
+                unpackedSize);
+
+            // the guessed dictionary: zeros and the stored chunks
+            std::vector<Byte> dic(window + unpackedSize);
+            auto& tracker = decoder.decoder.m_tracker;
+            auto windowStart = first.unpackedOffset - window;
+            for (auto c = segments[i].firstChunk; c-- != 0 && index.chunks[c].unpackedOffset + index.chunks[c].unpackedSize > windowStart; )
+            {
+                auto& chunk = index.chunks[c];
+                if (chunk.type != ChunkType::Stored)
+                    continue;
+
+                auto from = std::max(chunk.unpackedOffset, windowStart);
+                auto to = chunk.unpackedOffset + chunk.unpackedSize;
+                memcpy(&dic[(std::size_t)(from - windowStart)], srcBytes + chunk.packedOffset + 3 + (from - chunk.unpackedOffset),
+                    (std::size_t)(to - from));
+
+                Range known = { (std::size_t)(from - windowStart), (std::size_t)(to - windowStart) };
+                if (!tracker.known.empty() && tracker.known.back().begin == known.end)
+                    tracker.known.back().begin = known.begin;
+                else
+                    tracker.known.push_back(known);
+            }
+
+            std::reverse(tracker.known.begin(), tracker.known.end());
+            tracker.start = window;
+            tracker.end = dic.size();
+            try
+            {
+                details::DecodeSegment(decoder, &dic[0], window, processed[i], srcBytes, srcLen, index, segments[i]);
+            }
+            catch (details::GuessMissed&)
+            {
+                speculations[i].missed = true;
+                return;
+            }
+
+            memcpy(out, &dic[window], unpackedSize);
+
+            // dictionary positions to output positions
+            auto& speculation = speculations[i];
+            speculation.copies.swap(tracker.copies);
+            for (auto& copy : speculation.copies)
+            {
+                copy.dest += (std::size_t)windowStart;
+                copy.src += (std::size_t)windowStart;
+            }
+        });
+
+        std::size_t misses = 0;
+        for (std::size_t i = 0; i != segments.size(); ++i)
+        {
+            auto& speculation = speculations[i];
+            if (speculation.missed)
+            {
+                auto& first = index.chunks[segments[i].firstChunk];
+                auto dicStartPos = (std::size_t)(first.unpackedOffset - processed[i]);
+                LinearDecoder2 decoder(prop);
+                details::DecodeSegment(decoder, destBytes + dicStartPos, (std::size_t)processed[i], processed[i],
+                    srcBytes, srcLen, index, segments[i]);
+                ++misses;
+            }
+            else
+            {
+                for (auto& copy : speculation.copies)
+                    details::CopyMatch(destBytes + copy.dest, destBytes + copy.src, copy.len);
+            }
+
+            speculation = Speculation(); // free the memory as we go
+        }
+
+        destLen = (std::size_t)index.unpackedSize;
+        srcLen = (std::size_t)index.packedSize;
+        return misses;
+    }
+}
@@ -7,8 +7,10 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
+#include <type_traits>
 
 namespace lzma
 {
@@ -18,6 +20,35 @@ namespace lzma
 #   define LZMA_NOEXCEPT throw()
 #else
 #   define LZMA_NOEXCEPT noexcept
+#endif
+
+    // VC++2013 spells alignof __alignof, and its thread-local objects can't have constructors
+#if defined(_MSC_VER) && _MSC_VER <= 1800
+#   define LZMA_ALIGNOF(T) __alignof(T)
+#else
+#   define LZMA_ALIGNOF(T) alignof(T)
+#   define LZMA_HAS_THREAD_LOCAL 1
+#endif
+
+    // the decoding loop relies on its helper lambdas being inlined
+#if defined(__GNUC__)
+#   define LZMA_FORCEINLINE __attribute__((always_inline))
+#else
+#   define LZMA_FORCEINLINE
+#endif
+
+    // GCC and Clang on x86 also build the decoding loop for AVX2 + BMI2, and pick it at run time.
+    // Define LZMA_NO_CPU_DISPATCH to build the baseline only.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LZMA_NO_CPU_DISPATCH)
+#   define LZMA_CPU_DISPATCH 1
+#   define LZMA_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2"), flatten))
+#endif
+
+    // a hint to load the cache line at p; does nothing where there's no such builtin
+#if defined(__GNUC__)
+#   define LZMA_PREFETCH(p) __builtin_prefetch(p)
+#else
+#   define LZMA_PREFETCH(p) ((void)0)
 #endif
 
     struct BadStream : std::exception
@@ -69,6 +100,139 @@ namespace lzma
 
     /* ELzmaStatus is used only as output value for function call */
 
+    /// Number of readable bytes that must follow the input in InputSlack::Padded mode.
+    static const std::size_t InputPaddingSize = 20;
+
+    /* InputSlack tells the decoder what it may read past the end of the input block.
+
+    In the Padded mode the input block must hold the rest of the stream (or of the LZMA2 chunk)
+    and must be followed by at least InputPaddingSize readable bytes. The decoder then runs
+    the fast loop up to the very end of the input, without the lookahead checks near the end.
+    A stream that ends in the middle of a symbol is reported as BadStream. */
+    enum class InputSlack
+    {
+        None,   ///< nothing may be read past the input
+        Padded  ///< the input is complete and followed by InputPaddingSize readable bytes
+    };
+
+    /* ---------- Compile-time options ---------- */
+
+    /// The dictionary is a ring buffer: m_dic.pos goes back to 0 when it reaches m_dic.size.
+    struct RingWindow
+    {
+        static const bool wraps = true;
+    };
+
+    /** The dictionary is the whole output of the stream, starting at m_dic.mem.
+
+    m_dic.pos never wraps, so no ring arithmetic is needed. Use it only when the
+    dictionary buffer holds everything decoded since the first dictionary reset. */
+    struct LinearWindow
+    {
+        static const bool wraps = false;
+    };
+
+    /// Traits::Stats that counts nothing and compiles to nothing.
+    struct NoStats
+    {
+        void OnLiteral(bool /*matched*/) {}
+        void OnShortRep() {}
+        void OnMatch(unsigned /*len*/) {}
+        void OnRep(unsigned /*index*/, unsigned /*len*/) {}
+        void OnStored(std::size_t /*size*/) {}
+        void OnCheckedRun() {}
+        void OnRollback() {}
+        void OnTempBufFallback() {}
+    };
+
+    /// Traits::Stats that counts the decoded symbols and the slow paths of the decoder.
+    struct SymbolStats
+    {
+        std::uint64_t literals;         ///< literals decoded after a literal
+        std::uint64_t matchedLiterals;  ///< literals decoded after a match, with the byte at rep0 as context
+        std::uint64_t shortReps;        ///< one byte at rep0
+        std::uint64_t matches;          ///< matches with a new distance
+        std::uint64_t reps[4];          ///< matches at rep0 .. rep3
+        std::uint64_t matchLengths[8];  ///< matches and reps by length: [i] counts lengths 2^(i+1) .. 2^(i+2)-1
+        std::uint64_t matchBytes;       ///< output of matches and reps
+        std::uint64_t storedBytes;      ///< output of LZMA2 chunks stored without compression
+
+        std::uint64_t checkedRuns;      ///< decoding calls that check the input end at every symbol
+        std::uint64_t rollbacks;        ///< symbols undone because the input ended in them
+        std::uint64_t tempBufFallbacks; ///< input tails kept in tempBuf until more input comes
+
+        SymbolStats() { memset(this, 0, sizeof(*this)); }
+
+        void OnLiteral(bool matched) { ++(matched ? matchedLiterals : literals); }
+        void OnShortRep() { ++shortReps; }
+        void OnMatch(unsigned len) { ++matches; CountLength(len); }
+        void OnRep(unsigned index, unsigned len) { ++reps[index]; CountLength(len); }
+        void OnStored(std::size_t size) { storedBytes += size; }
+        void OnCheckedRun() { ++checkedRuns; }
+        void OnRollback() { ++rollbacks; }
+        void OnTempBufFallback() { ++tempBufFallbacks; }
+
+    private:
+        void CountLength(unsigned len)
+        {
+            unsigned i = 0;
+            while (len >= (4u << i))
+                ++i;
+
+            ++matchLengths[i];
+            matchBytes += len;
+        }
+    };
+
+    /** Traits::Tracker that is told nothing and compiles to nothing.
+
+    A tracker is told which dictionary bytes the decoding depends on, by m_dic position, before they are read:
+    OnRead - the bits in mask of the byte at pos pick the probabilities of a literal
+    (the previous byte, or the byte at rep0 after a match);
+    OnCopy - a match or a rep copies len bytes from src to dest.
+    A tracker may throw to stop the decoding, which leaves the decoder unusable. */
+    struct NoTracker
+    {
+        void OnRead(std::size_t /*pos*/, unsigned /*mask*/) {}
+        void OnCopy(std::size_t /*dest*/, std::size_t /*src*/, std::size_t /*len*/) {}
+    };
+
+    /// Derive from DefaultTraits and redefine the members to configure the decoder.
+    struct DefaultTraits
+    {
+        /// Type of a probability counter: std::uint16_t or std::uint32_t.
+        /// 11-bit probabilities fit in 16 bits, so the wider type only costs cache space.
+        typedef std::uint16_t Prob;
+
+        /// RingWindow or LinearWindow
+        typedef RingWindow Window;
+
+        /// Decode with 64-bit range coder registers that are refilled 4 input bytes at a time.
+        /// The output is the same; the speed depends on the CPU, see decoder_bench.
+        static const bool wideRangeCoder = false;
+
+        /// Prefetch match sources as soon as the distance is known, and the probabilities of the next literal.
+        /// Pays off with large dictionaries, where far matches miss the cache.
+        static const bool prefetch = false;
+
+        /// NoStats or SymbolStats; the counters are returned by Decoder2::GetStats()
+        typedef NoStats Stats;
+
+        /// Decode the bit trees (literals, lengths, distances) with conditional moves instead of branches.
+        /// Trades a few instructions per bit for no mispredictions, which pays off on poorly compressible data.
+        static const bool branchlessTrees = false;
+
+        /// Keep the per-state probabilities of each state together instead of in the SDK's separate arrays.
+        /// Only the memory layout changes, see DecoderCore::kStateBlockSize.
+        static const bool groupedProbs = false;
+
+        /// Run the AVX2 + BMI2 build of the decoding loop if the CPU has them (see LZMA_CPU_DISPATCH).
+        static const bool cpuDispatch = true;
+
+        /// NoTracker, or a type with the same members to follow the dictionary reads, see NoTracker
+        typedef NoTracker Tracker;
+    };
+
     /* ---------- LZMA Decoder state ---------- */
 
     /* LZMA_REQUIRED_INPUT_MAX = number of required input bytes for worst case.
@@ -77,7 +241,6 @@ namespace lzma
     namespace details
     {
         typedef std::uint32_t UInt32;
-        typedef std::uint32_t Prob; // can be std::uint16_t
 
         struct Properties
         {
@@ -85,13 +248,329 @@ namespace lzma
             unsigned dicSize;
         };
 
-        class DecoderCore
+        /* ---------- Match copying ---------- */
+
+        template<std::size_t N>
+        inline void CopyBlock(Byte* dest, const Byte* src)
+        {
+            memcpy(dest, src, N); // compiles to a single unaligned load/store pair
+        }
+
+        /// Copies len bytes between non-overlapping ranges, without touching bytes beyond dest + len.
+        inline void CopyDisjoint(Byte* dest, const Byte* src, std::size_t len)
+        {
+            if (len > 32)
+            {
+                memcpy(dest, src, len);
+            }
+            else if (len >= 16)
+            {
+                CopyBlock<16>(dest, src);
+                CopyBlock<16>(dest + len - 16, src + len - 16);
+            }
+            else if (len >= 8)
+            {
+                CopyBlock<8>(dest, src);
+                CopyBlock<8>(dest + len - 8, src + len - 8);
+            }
+            else if (len >= 4)
+            {
+                CopyBlock<4>(dest, src);
+                CopyBlock<4>(dest + len - 4, src + len - 4);
+            }
+            else
+            {
+                for (std::size_t i = 0; i < len; ++i)
+                    dest[i] = src[i];
+            }
+        }
+
+        /// Repeats the last distance bytes before dest; N-byte blocks need distance >= N and len >= N.
+        template<std::size_t N>
+        inline void CopyBlocks(Byte* dest, std::size_t distance, std::size_t len)
+        {
+            auto end = dest + len;
+            for (; dest + N <= end; dest += N)
+                CopyBlock<N>(dest, dest - distance);
+
+            // the last block overlaps the previous one and rewrites the same values
+            if (dest != end)
+                CopyBlock<N>(end - N, end - N - distance);
+        }
+
+        /** Copies an LZMA match: dest[i] = src[i] for i = 0 .. len-1, in that order.
+
+        src and dest must be in the same contiguous block (no dictionary wrap-around).
+        Writes exactly len bytes, so it is safe at the output limit and in a ring buffer.
+        */
+        inline void CopyMatch(Byte* dest, const Byte* src, std::size_t len)
+        {
+            if (src >= dest)
+            {
+                // the source wrapped around the ring and is still ahead of dest
+                memmove(dest, src, len);
+                return;
+            }
+
+            auto distance = std::size_t(dest - src);
+            if (distance >= len)
+            {
+                CopyDisjoint(dest, src, len);
+                return;
+            }
+
+            switch (distance)
+            {
+            case 1:
+                memset(dest, *src, len);
+                return;
+
+            case 2: case 4: case 8:
+                {
+                    Byte pattern[16];
+                    for (auto i = 0u; i < sizeof(pattern); ++i)
+                        pattern[i] = src[i % distance];
+
+                    for (; len >= 16; dest += 16, len -= 16)
+                        CopyBlock<16>(dest, pattern);
+
+                    for (std::size_t i = 0; i < len; ++i)
+                        dest[i] = pattern[i];
+                }
+                return;
+            }
+
+            if (distance < 16)
+            {
+                // write the first period bytes one by one, then copy from a multiple of distance >= 16
+                auto period = distance * ((16 + distance - 1) / distance);
+                auto head = period - distance;
+                if (head >= len)
+                {
+                    for (std::size_t i = 0; i < len; ++i)
+                        dest[i] = src[i];
+                    return;
+                }
+
+                for (std::size_t i = 0; i < head; ++i)
+                    dest[i] = src[i];
+
+                dest += head;
+                len -= head;
+                distance = period;
+
+                if (distance >= len)
+                {
+                    CopyDisjoint(dest, dest - distance, len);
+                    return;
+                }
+            }
+
+            if (distance >= 32)
+                CopyBlocks<32>(dest, distance, len);
+            else
+                CopyBlocks<16>(dest, distance, len);
+        }
+
+        /* ---------- Range decoders ---------- */
+
+        static const auto kNumTopBits = 24;
+        static const auto kTopValue = 1u << kNumTopBits;
+        static const auto kNumBitModelTotalBits = 11;
+
+        /** Range decoder of the LZMA SDK: 32-bit range and code, one input byte per normalization.
+
+        The decoder reads the input up to end. In the Checked mode it reads zeros past end,
+        so Position() > end tells that the input has ended in the middle of a symbol.
+        */
+        template<bool Checked>
+        class RangeDecoder32
         {
+        public:
+            RangeDecoder32() {} ///< unset, see FastRun
+
+            RangeDecoder32(const Byte* buf, const Byte* end, UInt32 range, UInt32 code)
+                : m_buf(buf), m_end(end), m_range(range), m_code(code), m_bound(0) {}
+
+            LZMA_FORCEINLINE void Normalize()
+            {
+                if (m_range < kTopValue)
+                {
+                    m_range <<= 8;
+                    m_code = (m_code << 8) | ((!Checked || m_buf < m_end) ? *m_buf : 0);
+                    ++m_buf;
+                }
+            }
+
+            /// Normalizes and tells whether the next bit, which has probability prob of being 0, is 0.
+            LZMA_FORCEINLINE bool IsBit0(unsigned prob)
+            {
+                Normalize();
+                m_bound = (m_range >> kNumBitModelTotalBits) * prob;
+                return m_code < m_bound;
+            }
+
+            LZMA_FORCEINLINE void Update0() { m_range = m_bound; }
+            LZMA_FORCEINLINE void Update1() { m_range -= m_bound; m_code -= m_bound; }
+
+            /// IsBit0 and the update in one step, without a branch on the bit.
+            LZMA_FORCEINLINE unsigned Bit(unsigned prob)
+            {
+                Normalize();
+                auto bound = (m_range >> kNumBitModelTotalBits) * prob;
+                auto mask = 0 - (UInt32)(m_code >= bound); // all ones for 1
+                m_range = bound ^ ((bound ^ (m_range - bound)) & mask);
+                m_code -= bound & mask;
+                return (unsigned)mask & 1;
+            }
+
+            /// Decodes a bit with fixed probability 1/2.
+            LZMA_FORCEINLINE unsigned DirectBit()
+            {
+                Normalize();
+                m_range >>= 1;
+                m_code -= m_range;
+                auto t = 0 - (m_code >> 31); /* (UInt32)((Int32)code >> 31) */
+                m_code += m_range & t;
+                return t + 1;
+            }
+
+            const Byte* Position() const { return m_buf; }
+            UInt32 Range() const { return m_range; }
+            UInt32 Code() const { return m_code; }
+
+        private:
+            const Byte* m_buf;
+            const Byte* m_end;
+            UInt32 m_range, m_code, m_bound;
+        };
+
+        /** Range decoder with a 64-bit bit reservoir, refilled 4 bytes at a time.
+
+        It keeps range and code scaled by the number of lookahead bits k (a multiple of 8):
+        m_range = range << k and m_code = (code << k) | lookahead. Normalization then only
+        gives a lookahead byte to the code (k -= 8), without a load and without a branch,
+        and the input is read once per 4 bytes. The decoded bits are the same as RangeDecoder32's.
+
+        The refill never reads past end: it takes zeros instead, like RangeDecoder32 in the Checked mode.
+        */
+        template<bool Checked>
+        class RangeDecoder64
+        {
+            typedef std::uint64_t UInt64;
+
+        public:
+            RangeDecoder64() {} ///< unset, see FastRun
+
+            RangeDecoder64(const Byte* buf, const Byte* end, UInt32 range, UInt32 code)
+                : m_buf(buf), m_end(end), m_range(range), m_code(code), m_bound(0), m_top(kTopValue), m_mask(~UInt64(0)), m_bits(0)
+            {
+                Refill();
+            }
+
+            LZMA_FORCEINLINE void Normalize()
+            {
+                // selects instead of branches: the compiler emits conditional moves
+                auto shift = m_range < m_top;
+                m_top = shift ? m_top >> 8 : m_top;
+                m_mask = shift ? (m_mask >> 8) | (UInt64(0xFF) << 56) : m_mask;
+                m_bits = shift ? m_bits - 8 : m_bits;
+
+                if (m_bits == 0)
+                    Refill();
+            }
+
+            /// Normalizes and tells whether the next bit, which has probability prob of being 0, is 0.
+            LZMA_FORCEINLINE bool IsBit0(unsigned prob)
+            {
+                Normalize();
+                // ((range >> 11) * prob) << k; the mask clears the bits of range shifted below k
+                m_bound = ((m_range >> kNumBitModelTotalBits) & m_mask) * prob;
+                return m_code < m_bound;
+            }
+
+            LZMA_FORCEINLINE void Update0() { m_range = m_bound; }
+            LZMA_FORCEINLINE void Update1() { m_range -= m_bound; m_code -= m_bound; }
+
+            /// IsBit0 and the update in one step, without a branch on the bit.
+            LZMA_FORCEINLINE unsigned Bit(unsigned prob)
+            {
+                Normalize();
+                auto bound = ((m_range >> kNumBitModelTotalBits) & m_mask) * prob;
+                auto mask = 0 - (UInt64)(m_code >= bound); // all ones for 1
+                m_range = bound ^ ((bound ^ (m_range - bound)) & mask);
+                m_code -= bound & mask;
+                return (unsigned)mask & 1;
+            }
+
+            /// Decodes a bit with fixed probability 1/2.
+            LZMA_FORCEINLINE unsigned DirectBit()
+            {
+                Normalize();
+                m_range = (m_range >> 1) & m_mask;
+                auto bit = m_code >= m_range;
+                m_code = bit ? m_code - m_range : m_code;
+                return bit;
+            }
+
+            /// Position of the first input byte not given to the code yet
+            const Byte* Position() const { return m_buf - (m_bits >> 3); }
+            UInt32 Range() const { return (UInt32)(m_range >> m_bits); }
+            UInt32 Code() const { return (UInt32)(m_code >> m_bits); }
+
         private:
-            static const auto kNumTopBits = 24;
-            static const auto kTopValue = 1u << kNumTopBits;
+            LZMA_FORCEINLINE void Refill()
+            {
+                UInt64 next = 0;
+                auto avail = m_end - m_buf;
+                if (avail >= 4)
+                {
+                    next = ((UInt64)m_buf[0] << 24) | ((UInt64)m_buf[1] << 16) | ((UInt64)m_buf[2] << 8) | m_buf[3];
+                }
+                else
+                {
+                    for (auto i = 0; i < 4; ++i)
+                        next = (next << 8) | (i < avail ? m_buf[i] : 0);
+                }
+
+                m_buf += 4;
+                m_range <<= 32;
+                m_code = (m_code << 32) | next;
+                m_top <<= 32;
+                m_mask <<= 32;
+                m_bits = 32;
+            }
+
+            const Byte* m_buf;
+            const Byte* m_end;
+            UInt64 m_range, m_code, m_bound;
+            UInt64 m_top;   ///< kTopValue << k
+            UInt64 m_mask;  ///< ~0 << k
+            unsigned m_bits; ///< k
+        };
+
+        /// Tells whether the CPU runs the LZMA_TARGET_AVX2 functions; checked once.
+        inline bool CpuHasAvx2Bmi2()
+        {
+#if defined(LZMA_CPU_DISPATCH)
+            static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"));
+            return has;
+#else
+            return false;
+#endif
+        }
+
+        /// Traits are described in DefaultTraits.
+        template<typename Traits>
+        class DecoderCore
+        {
+        public:
+            typedef typename Traits::Prob Prob;
+            typedef typename Traits::Window Window;
+            typedef typename Traits::Stats Stats;
+            typedef typename Traits::Tracker Tracker;
 
-            static const auto kNumBitModelTotalBits = 11;
+        private:
             static const auto kBitModelTotal = 1 << kNumBitModelTotalBits;
             static const auto kNumMoveBits = 5;
 
@@ -128,13 +607,21 @@ namespace lzma
             static const auto kMatchMinLen = 2;
             static const auto kMatchSpecLenStart = kMatchMinLen + kLenNumLowSymbols + kLenNumMidSymbols + kLenNumHighSymbols;
 
+            /* The per-state probabilities: IsMatch and IsRep0Long are indexed by StateRow(state) + posState,
+            IsRep .. IsRepG2 by StateCol(state). The SDK layout keeps each kind in its own array.
+            The grouped layout (Traits::groupedProbs) keeps those of one state together, in the order
+            IsMatch[16], IsRep, IsRepG0, IsRepG1, IsRepG2, IsRep0Long[16], so the first bits of a
+            symbol read one or two cache lines instead of up to four. */
+            static const bool kGrouped = Traits::groupedProbs;
+            static const auto kStateBlockSize = 2 * kNumPosStatesMax + 4;
+
             static const auto IsMatch = 0;
-            static const auto IsRep = IsMatch + (kNumStates << kNumPosBitsMax);
-            static const auto IsRepG0 = IsRep + kNumStates;
-            static const auto IsRepG1 = IsRepG0 + kNumStates;
-            static const auto IsRepG2 = IsRepG1 + kNumStates;
-            static const auto IsRep0Long = IsRepG2 + kNumStates;
-            static const auto PosSlot = IsRep0Long + (kNumStates << kNumPosBitsMax);
+            static const auto IsRep = IsMatch + (kGrouped ? kNumPosStatesMax : kNumStates << kNumPosBitsMax);
+            static const auto IsRepG0 = IsRep + (kGrouped ? 1 : kNumStates);
+            static const auto IsRepG1 = IsRepG0 + (kGrouped ? 1 : kNumStates);
+            static const auto IsRepG2 = IsRepG1 + (kGrouped ? 1 : kNumStates);
+            static const auto IsRep0Long = IsRepG2 + (kGrouped ? 1 : kNumStates);
+            static const auto PosSlot = kGrouped ? kNumStates * kStateBlockSize : IsRep0Long + (kNumStates << kNumPosBitsMax);
             static const auto SpecPos = PosSlot + (kNumLenToPosStates << kNumPosSlotBits);
             static const auto Align = SpecPos + kNumFullDistances - kEndPosModelIndex;
             static const auto LenCoder = Align + kAlignTableSize;
@@ -143,12 +630,29 @@ namespace lzma
 
             static const auto LZMA_LIT_SIZE = 768;
 
+            /// upper bound on the probabilities updated while decoding one symbol
+            static const auto kMaxProbsPerSymbol = 32;
+
         public:
             static const auto LZMA_REQUIRED_INPUT_MAX = 20u;
 
             static const auto RC_INIT_SIZE = 5u;
 
-            DecoderCore() {}
+            static_assert(LZMA_REQUIRED_INPUT_MAX <= InputPaddingSize, "padding is too small");
+
+            DecoderCore()
+                : m_yieldFastRuns(false)
+                , m_avx2(Traits::cpuDispatch && CpuHasAvx2Bmi2())
+                , m_decodeReal(Kernel<kAnyProp, kAnyProp, kAnyProp, false>())
+                , m_decodeRealChecked(Kernel<kAnyProp, kAnyProp, kAnyProp, true>())
+                , m_writeRem(&DecoderCore::WriteRem)
+                , m_fastBufLimit(nullptr)
+            {
+#if defined(LZMA_CPU_DISPATCH)
+                if (m_avx2)
+                    m_writeRem = &DecoderCore::WriteRemAvx2;
+#endif
+            }
 
             static std::size_t calcProbSize(unsigned lcPlusLp)
             {
@@ -158,6 +662,23 @@ namespace lzma
                 return LZMA_BASE_SIZE + (LZMA_LIT_SIZE << lcPlusLp);
             }
 
+            /// Sets lc/lp/pb and selects the decoding loop compiled for them.
+            void SetLcLpPb(unsigned lc, unsigned lp, unsigned pb)
+            {
+                m_properties.lc = lc;
+                m_properties.lp = lp;
+                m_properties.pb = pb;
+
+                if (lc == 3 && lp == 0 && pb == 2)
+                    m_decodeReal = Kernel<3, 0, 2, false>();
+                else if (lc == 0 && lp == 2 && pb == 2)
+                    m_decodeReal = Kernel<0, 2, 2, false>();
+                else if (lc == 4 && lp == 0 && pb == 0)
+                    m_decodeReal = Kernel<4, 0, 0, false>();
+                else
+                    m_decodeReal = Kernel<kAnyProp, kAnyProp, kAnyProp, false>();
+            }
+
             void InitDicAndState(bool initDic, bool initState)
             {
                 needFlush = true;
@@ -175,11 +696,61 @@ namespace lzma
                     needInitState = true;
             }
 
+            /// Internal. (Used by LZMA2 checkpoints) What the decoding depends on between two LZMA2 chunks,
+            /// besides the probabilities and the dictionary: the range coder starts anew in every chunk.
+            struct ChunkBoundaryState
+            {
+                UInt32 processedPos;
+                UInt32 checkDicSize;
+                UInt32 state;
+                UInt32 reps[4];
+                bool needInitState;
+            };
+
+            ChunkBoundaryState GetChunkBoundaryState() const
+            {
+                ChunkBoundaryState s = { processedPos, checkDicSize, state, { reps[0], reps[1], reps[2], reps[3] }, needInitState };
+                return s;
+            }
+
+            void SetChunkBoundaryState(const ChunkBoundaryState& s)
+            {
+                if (s.state >= kNumStates)
+                    throw std::invalid_argument("state");
+
+                processedPos = s.processedPos;
+                checkDicSize = s.checkDicSize;
+                state = s.state;
+                for (auto i = 0; i != 4; ++i)
+                    reps[i] = s.reps[i];
+                needInitState = s.needInitState;
+
+                needFlush = true;
+                remainLen = 0;
+                tempBufSize = 0;
+            }
+
+            /// Internal. (Used by LZMA2 decoder to start in the middle of a stream)
+            /// size - the number of bytes decoded since the last dictionary reset
+            void SetProcessedSize(std::uint64_t size)
+            {
+                this->processedPos = (UInt32)size;
+                this->checkDicSize = (size >= m_properties.dicSize) ? m_properties.dicSize : 0;
+            }
+
             /// Internal. (Used by LZMA2 decoder)
             void UpdateWithUncompressed(const void* src, std::size_t size) 
             {
                 memcpy(m_dic.mem + m_dic.pos, src, size);
+                SkipUncompressed(size);
+            }
+
+            /// Internal. (Used by BufDecoder2) UpdateWithUncompressed for bytes the caller writes to
+            /// the dictionary itself, or not at all when no later chunk can refer to them.
+            void SkipUncompressed(std::size_t size)
+            {
                 m_dic.pos += size;
+                m_stats.OnStored(size);
 
                 if (this->checkDicSize == 0 && this->m_properties.dicSize - this->processedPos <= size)
                     this->checkDicSize = this->m_properties.dicSize;
@@ -190,6 +761,7 @@ namespace lzma
             /** The decoding to internal dictionary buffer (CLzmaDec::dic).
 
             You must manually update CLzmaDec::dicPos, if it reaches CLzmaDec::dicBufSize !!!
+            (It never does with LinearWindow.)
 
             finishMode:
                 It has meaning only if the decoding reaches output limit (dicLimit).
@@ -201,18 +773,34 @@ namespace lzma
                 Status::NOT_FINISHED
                 Status::NEEDS_MORE_INPUT
                 Status::MAYBE_FINISHED_WITHOUT_MARK
+
+            slack:
+                InputSlack::Padded - see InputSlack, the input must hold the rest of the stream.
             */
-            void DecodeToDic(std::size_t dicLimit, const void* src, std::size_t& srcLen, FinishMode finishMode, Status& status)
+            void DecodeToDic(std::size_t dicLimit, const void* src, std::size_t& srcLen, FinishMode finishMode, Status& status,
+                InputSlack slack = InputSlack::None)
             {
                 auto srcBytes = static_cast<const Byte*>(src);
                 auto inSize = srcLen;
                 srcLen = 0;
-                WriteRem(dicLimit);
+                (this->*m_writeRem)(dicLimit);
 
                 status = Status::NotSpecified;
 
                 while (this->remainLen != kMatchSpecLenStart)
                 {
+                    if (this->needFlush && this->tempBufSize == 0 && inSize >= RC_INIT_SIZE)
+                    {
+                        // the usual case: the range coder init bytes are all in the input
+                        if (srcBytes[0] != 0)
+                            throw BadStream();
+
+                        InitRc(srcBytes);
+                        srcLen += RC_INIT_SIZE;
+                        srcBytes += RC_INIT_SIZE;
+                        inSize -= RC_INIT_SIZE;
+                    }
+
                     if (this->needFlush)
                     {
                         for (; inSize > 0 && this->tempBufSize < RC_INIT_SIZE; srcLen++, inSize--)
@@ -257,41 +845,47 @@ namespace lzma
 
                     if (this->tempBufSize == 0)
                     {
-                        const Byte *bufLimit;
-                        if (inSize < LZMA_REQUIRED_INPUT_MAX || checkEndMarkNow)
-                        {
-                            auto dummyRes = TryDummy(srcBytes, inSize);
-
-                            if (dummyRes == DUMMY_ERROR)
-                            {
-                                memcpy(this->tempBuf, srcBytes, inSize);
-                                this->tempBufSize = (unsigned)inSize;
-                                srcLen += inSize;
-                                status = Status::NeedsMoreInput;
-                                return;
-                            }
-
-                            if (checkEndMarkNow && dummyRes != DUMMY_MATCH)
-                            {
-                                status = Status::NotFinished;
-                                throw BadStream();
-                            }
+                        this->buf = srcBytes;
 
-                            bufLimit = srcBytes;
-                        }
-                        else
+                        if (m_yieldFastRuns && !checkEndMarkNow && (slack == InputSlack::Padded || inSize >= LZMA_REQUIRED_INPUT_MAX))
                         {
-                            bufLimit = srcBytes + inSize - LZMA_REQUIRED_INPUT_MAX;
+                            // the caller runs the fast loop, see FastRun
+                            m_fastDicLimit = dicLimit;
+                            m_fastBufLimit = srcBytes + inSize - (slack == InputSlack::Padded ? 0 : LZMA_REQUIRED_INPUT_MAX);
+                            m_fastSrcEnd = srcBytes + inSize;
+                            status = Status::NotFinished;
+                            return;
                         }
 
-                        this->buf = srcBytes;
-
-                        DecodeReal2(dicLimit, bufLimit);
+                        auto exhausted = false;
+                        if (slack == InputSlack::Padded && !checkEndMarkNow)
+                            DecodeReal2<false>(dicLimit, srcBytes + inSize);
+                        else if (inSize >= LZMA_REQUIRED_INPUT_MAX && !checkEndMarkNow)
+                            DecodeReal2<false>(dicLimit, srcBytes + inSize - LZMA_REQUIRED_INPUT_MAX);
+                        else
+                            exhausted = DecodeReal2<true>(dicLimit, srcBytes + inSize);
 
                         auto processed = std::size_t(this->buf - srcBytes);
+                        if (processed > inSize)
+                            throw BadStream(); // the last symbol ran into the padding
+
                         srcLen += processed;
                         srcBytes += processed;
                         inSize -= processed;
+
+                        if (exhausted)
+                        {
+                            if (inSize >= LZMA_REQUIRED_INPUT_MAX)
+                                throw BadStream(); // no symbol is that long
+
+                            m_stats.OnTempBufFallback();
+                            // keep the beginning of the incomplete symbol until more input comes
+                            memcpy(this->tempBuf, srcBytes, inSize);
+                            this->tempBufSize = (unsigned)inSize;
+                            srcLen += inSize;
+                            status = Status::NeedsMoreInput;
+                            return;
+                        }
                     }
                     else
                     {
@@ -300,29 +894,25 @@ namespace lzma
                         while (rem < LZMA_REQUIRED_INPUT_MAX && lookAhead < inSize)
                             this->tempBuf[rem++] = srcBytes[lookAhead++];
 
-                        this->tempBufSize = rem;
+                        this->buf = this->tempBuf;
 
-                        if (rem < LZMA_REQUIRED_INPUT_MAX || checkEndMarkNow)
-                        {
-                            auto dummyRes = TryDummy(this->tempBuf, rem);
-                            if (dummyRes == DUMMY_ERROR)
-                            {
-                                srcLen += lookAhead;
-                                status = Status::NeedsMoreInput;
-                                return;
-                            }
-                            if (checkEndMarkNow && dummyRes != DUMMY_MATCH)
-                            {
-                                status = Status::NotFinished;
-                                throw BadStream();
-                            }
-                        }
+                        auto exhausted = DecodeReal2<true>(dicLimit, this->tempBuf + rem);
+                        auto consumed = (unsigned)(this->buf - this->tempBuf);
 
-                        this->buf = this->tempBuf;
+                        if (exhausted && consumed == 0)
+                        {
+                            if (rem == LZMA_REQUIRED_INPUT_MAX)
+                                throw BadStream(); // no symbol is that long
 
-                        DecodeReal2(dicLimit, this->buf);
+                            m_stats.OnTempBufFallback();
+                            this->tempBufSize = rem;
+                            srcLen += lookAhead;
+                            status = Status::NeedsMoreInput;
+                            return;
+                        }
 
-                        lookAhead -= (rem - (unsigned)(this->buf - this->tempBuf));
+                        // the first symbol used all the old bytes, so the rest of tempBuf came from src
+                        lookAhead -= (rem - consumed);
                         srcLen += lookAhead;
                         srcBytes += lookAhead;
                         inSize -= lookAhead;
@@ -338,15 +928,61 @@ namespace lzma
             }
 
             DictView m_dic;
-            Properties m_properties;
+            Stats m_stats;
+            Tracker m_tracker;
+            Properties m_properties; ///< lc, lp and pb must be changed through SetLcLpPb()
             Prob* m_probs;
 
+            /// Internal. (Used by Lzma2DecodeBatch) DecodeToDic stops where it would run the fast loop, see FastRun.
+            bool m_yieldFastRuns;
+
+            /// Internal. DecodeToDic has stopped at a fast loop, see BeginFastRun.
+            bool AtFastRun() const { return m_fastBufLimit != nullptr; }
+
+            /// Internal. The LZMA_TARGET_AVX2 builds are run, see Traits::cpuDispatch.
+            bool RunsAvx2() const { return m_avx2; }
+
         private:
+            /// DecodeReal template argument meaning "read the value from m_properties"
+            static const int kAnyProp = -1;
+
+            typedef bool (DecoderCore::*DecodeRealFn)(std::size_t limit, const Byte *bufLimit);
+            typedef void (DecoderCore::*WriteRemFn)(std::size_t limit);
+
+            bool m_avx2; ///< run the LZMA_TARGET_AVX2 builds
+            DecodeRealFn m_decodeReal; ///< unchecked kernel for the current lc, lp and pb
+            DecodeRealFn m_decodeRealChecked;
+            WriteRemFn m_writeRem;
+
+            static unsigned StateRow(unsigned state) { return kGrouped ? state * kStateBlockSize : state << kNumPosBitsMax; }
+            static unsigned StateCol(unsigned state) { return kGrouped ? state * kStateBlockSize : state; }
+
+            template<int LC, int LP, int PB, bool Checked>
+            DecodeRealFn Kernel() const
+            {
+#if defined(LZMA_CPU_DISPATCH)
+                if (m_avx2)
+                    return &DecoderCore::DecodeRealAvx2<LC, LP, PB, Checked>;
+#endif
+                return &DecoderCore::DecodeReal<LC, LP, PB, Checked>;
+            }
+
+            /// Resets the probabilities in use: the literal rows of lc + lp only, the rest of the table is never read.
             void InitStateReal()
             {
-                auto numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (m_properties.lc + m_properties.lp));
+                std::size_t numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (m_properties.lc + m_properties.lp));
 
-                for (auto i = 0u; i < numProbs; i++)
+                // 32-byte stores at any optimization level
+                static const auto kBlockSize = 32 / sizeof(Prob);
+                Prob block[kBlockSize];
+                for (auto& prob : block)
+                    prob = kBitModelTotal >> 1;
+
+                std::size_t i = 0;
+                for (; i + kBlockSize <= numProbs; i += kBlockSize)
+                    memcpy(m_probs + i, block, sizeof(block));
+
+                for (; i < numProbs; i++)
                     m_probs[i] = kBitModelTotal >> 1;
 
                 this->reps[0] = 1;
@@ -364,419 +1000,744 @@ namespace lzma
                 needFlush = false;
             }
 
-            void DecodeReal2(std::size_t limit, const Byte *bufLimit)
+            /// The output limit of a DecodeReal call: the first one stops when the dictionary is full, see checkDicSize.
+            std::size_t RunLimit(std::size_t limit) const
+            {
+                if (this->checkDicSize == 0)
+                {
+                    UInt32 rem = m_properties.dicSize - this->processedPos;
+                    if (limit - m_dic.pos > rem)
+                        return m_dic.pos + rem;
+                }
+
+                return limit;
+            }
+
+            /// Checked: see DecodeReal. Returns true if the input ended in the middle of a symbol.
+            template<bool Checked>
+            bool DecodeReal2(std::size_t limit, const Byte *bufLimit)
             {
+                auto exhausted = false;
                 do
                 {
-                    auto limit2 = limit;
-                    if (this->checkDicSize == 0)
+                    auto limit2 = RunLimit(limit);
+                    if (Checked)
                     {
-                        UInt32 rem = m_properties.dicSize - this->processedPos;
-                        if (limit - m_dic.pos > rem)
-                            limit2 = m_dic.pos + rem;
+                        m_stats.OnCheckedRun();
+                        exhausted = (this->*m_decodeRealChecked)(limit2, bufLimit);
                     }
-
-                    DecodeReal(limit2, bufLimit);
+                    else
+                        (this->*m_decodeReal)(limit2, bufLimit);
 
                     if (this->processedPos >= m_properties.dicSize)
                         this->checkDicSize = m_properties.dicSize;
 
-                    WriteRem(limit);
+                    (this->*m_writeRem)(limit);
                 }
-                while (m_dic.pos < limit && this->buf < bufLimit && this->remainLen < kMatchSpecLenStart);
+                while (m_dic.pos < limit && !exhausted && (Checked || this->buf < bufLimit) && this->remainLen < kMatchSpecLenStart);
 
                 if (this->remainLen > kMatchSpecLenStart)
                     this->remainLen = kMatchSpecLenStart;
+
+                return exhausted;
             }
 
-            /* First LZMA-symbol is always decoded.
-            And it decodes new LZMA-symbols while (buf < bufLimit), but "buf" is without last normalization
-            Out:
-                Result:
-                    SZ_OK - OK
+            template<bool Checked>
+            using RangeDecoderFor = typename std::conditional<Traits::wideRangeCoder, RangeDecoder64<Checked>, RangeDecoder32<Checked>>::type;
+
+            /// What the decoding loop keeps in registers, see DecodeSymbol.
+            template<typename RangeDecoder>
+            struct Registers
+            {
+                RangeDecoder rc;
+                Prob* probs;
+                Byte* dic;
+                std::size_t dicBufSize;
+                std::size_t dicPos;
+                UInt32 processedPos;
+                UInt32 checkDicSize;
+                unsigned state;
+                UInt32 rep0, rep1, rep2, rep3;
+                unsigned len;
+                unsigned pbMask, lpMask, lc; ///< for the kernels of any lc, lp and pb
+            };
+
+            /// Checked mode: the registers at the start of the symbol and the probabilities it has changed
+            template<typename RangeDecoder>
+            struct Rollback
+            {
+                explicit Rollback(const Registers<RangeDecoder>& r) : snapshot(r), undoSize(0), exhausted(false) {}
+
+                Registers<RangeDecoder> snapshot;
+                struct Undo { Prob* prob; unsigned value; } undo[kMaxProbsPerSymbol];
+                unsigned undoSize;
+                bool exhausted;
+            };
+
+            template<typename RangeDecoder>
+            Registers<RangeDecoder> LoadRegisters(const RangeDecoder& rc) const
+            {
+                Registers<RangeDecoder> r = { rc, m_probs, m_dic.mem, m_dic.size, m_dic.pos, this->processedPos, this->checkDicSize, this->state,
+                    this->reps[0], this->reps[1], this->reps[2], this->reps[3], 0,
+                    ((unsigned)1 << m_properties.pb) - 1, ((unsigned)1 << m_properties.lp) - 1, m_properties.lc };
+                return r;
+            }
+
+            template<typename RangeDecoder>
+            void StoreRegisters(Registers<RangeDecoder>& r)
+            {
+                r.rc.Normalize();
+                this->buf = r.rc.Position();
+                this->m_range = r.rc.Range();
+                this->m_code = r.rc.Code();
+                this->remainLen = r.len;
+                m_dic.pos = r.dicPos;
+                this->processedPos = r.processedPos;
+                this->reps[0] = r.rep0;
+                this->reps[1] = r.rep1;
+                this->reps[2] = r.rep2;
+                this->reps[3] = r.rep3;
+                this->state = r.state;
+            }
+
+        public:
+            /** Internal. (Used by Lzma2DecodeBatch) The fast loop DecodeToDic has stopped at, with m_yieldFastRuns:
+            the caller steps through it a symbol at a time, so the loops of several decoders can be interleaved. */
+            struct FastRun
+            {
+                Registers<RangeDecoderFor<false>> r;
+                std::size_t limit, limit2; ///< as in DecodeReal2
+                const Byte* bufLimit;
+                const Byte* srcStart;
+                const Byte* srcEnd;
+                std::size_t dicStart;
+            };
+
+            /// Starts the fast loop at which DecodeToDic has stopped, see AtFastRun.
+            FastRun BeginFastRun()
+            {
+                FastRun run;
+                run.limit = m_fastDicLimit;
+                run.bufLimit = m_fastBufLimit;
+                run.srcStart = this->buf;
+                run.srcEnd = m_fastSrcEnd;
+                run.dicStart = m_dic.pos;
+                m_fastBufLimit = nullptr;
+
+                LoadFastRun(run);
+                return run;
+            }
+
+            /// Decodes a symbol of run, returns false when the loop must stop, then EndFastRun is called.
+            LZMA_FORCEINLINE bool StepFastRun(FastRun& run)
+            {
+                Rollback<RangeDecoderFor<false>> unused(run.r);
+                return DecodeSymbol<kAnyProp, kAnyProp, kAnyProp, false>(run.r, unused, run.limit2, run.bufLimit) &&
+                    run.r.dicPos < run.limit2 && run.r.rc.Position() < run.bufLimit;
+            }
+
+            /** Ends a stop of run as DecodeReal2 ends a call of the loop. Returns true if the loop goes on, at the
+            dictionary size. Otherwise srcLen is set to the input used since BeginFastRun: the caller passes
+            the rest to DecodeToDic. */
+            bool EndFastRun(FastRun& run, std::size_t& srcLen)
+            {
+                StoreRegisters(run.r);
+
+                if (this->processedPos >= m_properties.dicSize)
+                    this->checkDicSize = m_properties.dicSize;
+
+                (this->*m_writeRem)(run.limit);
+
+                if (m_dic.pos < run.limit && this->buf < run.bufLimit && this->remainLen < kMatchSpecLenStart)
+                {
+                    LoadFastRun(run);
+                    return true;
+                }
+
+                if (this->remainLen > kMatchSpecLenStart)
+                    this->remainLen = kMatchSpecLenStart;
+
+                if (this->buf > run.srcEnd)
+                    throw BadStream(); // the last symbol ran into the padding
+
+                srcLen = std::size_t(this->buf - run.srcStart);
+                return false;
+            }
+
+        private:
+            const Byte* m_fastBufLimit; ///< of the fast loop DecodeToDic has stopped at, or nullptr
+            const Byte* m_fastSrcEnd;
+            std::size_t m_fastDicLimit;
+
+            void LoadFastRun(FastRun& run) const
+            {
+                run.limit2 = RunLimit(run.limit);
+                run.r = LoadRegisters(RangeDecoderFor<false>(this->buf, run.bufLimit + LZMA_REQUIRED_INPUT_MAX, this->m_range, this->m_code));
+            }
+
+            /* First LZMA-symbol is always decoded.
+            And it decodes new LZMA-symbols while (buf < bufLimit), but "buf" is without last normalization
+            Out:
+                Result:
+                    SZ_OK - OK
                     SZ_ERROR_DATA - Error
                 this->remainLen:
                     < kMatchSpecLenStart : normal remain
                     = kMatchSpecLenStart : finished
                     = kMatchSpecLenStart + 1 : Flush marker
                     = kMatchSpecLenStart + 2 : State Init Marker
+
+            LC, LP and PB are either compile-time properties or kAnyProp;
+            SetLcLpPb() picks the instantiation matching m_properties.
+
+            Checked:
+                bufLimit is the end of the input, and symbols are decoded while they fit in it.
+                A symbol which runs out of input is rolled back (registers and probabilities),
+                and the function returns true. In this mode the first symbol may be at the
+                output limit: only the end mark is accepted there.
             */
-            void DecodeReal(std::size_t limit, const Byte *bufLimit)
+            template<int LC, int LP, int PB, bool Checked>
+            bool DecodeReal(std::size_t limit, const Byte *bufLimit)
             {
-                auto probs = m_probs;
+                typedef RangeDecoderFor<Checked> RangeDecoder;
 
-                unsigned state = this->state;
-                UInt32 rep0 = this->reps[0], rep1 = this->reps[1], rep2 = this->reps[2], rep3 = this->reps[3];
-                unsigned pbMask = ((unsigned)1 << (m_properties.pb)) - 1;
-                unsigned lpMask = ((unsigned)1 << (m_properties.lp)) - 1;
-                unsigned lc = m_properties.lc;
+                // the unchecked loop may read LZMA_REQUIRED_INPUT_MAX bytes past bufLimit
+                auto r = LoadRegisters(RangeDecoder(this->buf, Checked ? bufLimit : bufLimit + LZMA_REQUIRED_INPUT_MAX, this->m_range, this->m_code));
+                Rollback<RangeDecoder> rollback(r);
 
-                auto dic = m_dic.mem;
-                auto dicBufSize = m_dic.size;
-                auto dicPos = m_dic.pos;
+                do
+                {
+                    if (!DecodeSymbol<LC, LP, PB, Checked>(r, rollback, limit, bufLimit))
+                        break;
+                }
+                while (r.dicPos < limit && (Checked || r.rc.Position() < bufLimit));
 
-                UInt32 processedPos = this->processedPos;
-                UInt32 checkDicSize = this->checkDicSize;
-                unsigned len = 0;
+                StoreRegisters(r);
+                return rollback.exhausted;
+            }
+
+            /** Decodes a symbol of DecodeReal with the registers r: a literal, or a match up to limit, the rest
+            of it is left in r.len. Returns false if the decoding must stop there: after the end mark, or
+            in the Checked mode when the input has ended in the symbol, which is rolled back. */
+            template<int LC, int LP, int PB, bool Checked, typename RangeDecoder>
+            LZMA_FORCEINLINE bool DecodeSymbol(Registers<RangeDecoder>& r, Rollback<RangeDecoder>& rollback, std::size_t limit, const Byte *bufLimit)
+            {
+                auto& rc = r.rc;
+                auto& state = r.state;
+                auto& rep0 = r.rep0;
+                auto& rep1 = r.rep1;
+                auto& rep2 = r.rep2;
+                auto& rep3 = r.rep3;
+                auto& dicPos = r.dicPos;
+                auto& processedPos = r.processedPos;
+                auto& len = r.len;
+
+                const auto probs = r.probs;
+                const auto dic = r.dic;
+                const auto dicBufSize = r.dicBufSize;
+                const auto checkDicSize = r.checkDicSize;
+                const unsigned pbMask = (PB == kAnyProp) ? r.pbMask : ((unsigned)1 << PB) - 1;
+                const unsigned lpMask = (LP == kAnyProp) ? r.lpMask : ((unsigned)1 << LP) - 1;
+                const unsigned lc = (LC == kAnyProp) ? r.lc : LC;
+
+                auto& stats = m_stats;
+                auto& tracker = m_tracker;
+
+                // position of the byte at the distance dist (1 - the previous byte)
+                auto dicPosBack = [&](UInt32 dist) LZMA_FORCEINLINE -> std::size_t
+                {
+                    return (dicPos - dist) + ((Window::wraps && dicPos < dist) ? dicBufSize : 0);
+                };
 
-                const Byte *buf = this->buf;
-                UInt32 range = this->m_range;
-                UInt32 code = this->m_code;
+                if (Checked)
+                {
+                    rollback.snapshot.rc = rc;
+                    rollback.snapshot.state = state;
+                    rollback.snapshot.rep0 = rep0;
+                    rollback.snapshot.rep1 = rep1;
+                    rollback.snapshot.rep2 = rep2;
+                    rollback.snapshot.rep3 = rep3;
+                    rollback.undoSize = 0;
+                }
 
-                auto NORMALIZE = [&]
+                // Checked mode: returns false and rolls the symbol back if the input has ended in it.
+                // The normalization after the symbol is done here too, so it must fit as well.
+                auto symbolFits = [&]() LZMA_FORCEINLINE -> bool
                 {
-                    if (range < kTopValue)
+                    if (!Checked)
+                        return true;
+
+                    rc.Normalize();
+                    if (rc.Position() <= bufLimit)
+                        return true;
+
+                    rollback.exhausted = true;
+                    m_stats.OnRollback();
+
+                    while (rollback.undoSize != 0)
                     {
-                        range <<= 8;
-                        code = (code << 8) | (*buf++);
+                        --rollback.undoSize;
+                        *rollback.undo[rollback.undoSize].prob = (Prob)rollback.undo[rollback.undoSize].value;
                     }
+
+                    rc = rollback.snapshot.rc;
+                    state = rollback.snapshot.state;
+                    rep0 = rollback.snapshot.rep0;
+                    rep1 = rollback.snapshot.rep1;
+                    rep2 = rollback.snapshot.rep2;
+                    rep3 = rollback.snapshot.rep3;
+                    len = 0;
+                    return false;
                 };
 
-                do
-                {
-                    UInt32 bound;
-                    unsigned ttt;
+                unsigned ttt;
+
+                unsigned posState = processedPos & pbMask;
+                int repIndex = -1; // for the stats
 
-                    unsigned posState = processedPos & pbMask;
+                auto isBit0 = [&](Prob* x) LZMA_FORCEINLINE -> bool
+                {
+                    ttt = *x;
+                    return rc.IsBit0(ttt);
+                };
 
-                    auto isBit0 = [&](Prob* x) -> bool
+                auto saveProb = [&](Prob* x) LZMA_FORCEINLINE
+                {
+                    if (Checked)
                     {
-                        ttt = *x;
-                        NORMALIZE();
-                        bound = (range >> kNumBitModelTotalBits) * ttt;
-                        return code < bound;
-                    };
+                        rollback.undo[rollback.undoSize].prob = x;
+                        rollback.undo[rollback.undoSize].value = ttt;
+                        ++rollback.undoSize;
+                    }
+                };
+
+                auto UPDATE_0 = [&](Prob* x) LZMA_FORCEINLINE
+                {
+                    saveProb(x);
+                    rc.Update0();
+                    *x = (Prob)(ttt + ((kBitModelTotal - ttt) >> kNumMoveBits));
+                };
+
+                auto UPDATE_1 = [&](Prob* x) LZMA_FORCEINLINE
+                {
+                    saveProb(x);
+                    rc.Update1();
+                    *x = (Prob)(ttt - (ttt >> kNumMoveBits));
+                };
 
-                    auto UPDATE_0 = [&](Prob* x)
+#define LZMA_DECODER_DETAILS_GET_BIT2_(x, i, A0, A1) if (isBit0(x)) { UPDATE_0(x); i = (i + i); A0; } else { UPDATE_1(x); i = (i + i) + 1; A1; }
+
+                // Traits::branchlessTrees: decodes a bit and updates *x, returns the bit
+                auto bitNoBranch = [&](Prob* x) LZMA_FORCEINLINE -> unsigned
+                {
+                    ttt = *x;
+                    saveProb(x);
+                    auto bit = rc.Bit(ttt);
+                    // selects with a mask, the compiler turns ?: into a branch
+                    unsigned p0 = ttt + ((kBitModelTotal - ttt) >> kNumMoveBits), p1 = ttt - (ttt >> kNumMoveBits);
+                    *x = (Prob)(p0 ^ ((p0 ^ p1) & (0u - bit)));
+                    return bit;
+                };
+
+                auto GET_BIT = [&](Prob* x, unsigned& i) LZMA_FORCEINLINE
+                {
+                    if (Traits::branchlessTrees)
+                        i = (i + i) + bitNoBranch(x);
+                    else
+                        LZMA_DECODER_DETAILS_GET_BIT2_(x, i, ; , ;)
+                };
+
+                auto TREE_GET_BIT = [&](Prob* probs, unsigned& i) LZMA_FORCEINLINE { GET_BIT(probs + i, i); };
+                auto TREE_DECODE = [&](Prob* probs, unsigned limit, unsigned& i) LZMA_FORCEINLINE
+                {
+                    i = 1;
+                    do
                     {
-                        range = bound;
-                        *x = (Prob)(ttt + ((kBitModelTotal - ttt) >> kNumMoveBits));
-                    };
+                        TREE_GET_BIT(probs, i);
+                    }
+                    while (i < limit);
+                    i -= limit;
+                };
+
+                // #define _LZMA_SIZE_OPT
+#ifdef _LZMA_SIZE_OPT
+                auto TREE_6_DECODE = [&](Prob* probs, unsigned& i) LZMA_FORCEINLINE { TREE_DECODE(probs, (1 << 6), i); };
+#else
+                auto TREE_6_DECODE = [&](Prob* probs, unsigned& i) LZMA_FORCEINLINE
+                {
+                    i = 1;
+                    TREE_GET_BIT(probs, i);
+                    TREE_GET_BIT(probs, i);
+                    TREE_GET_BIT(probs, i);
+                    TREE_GET_BIT(probs, i);
+                    TREE_GET_BIT(probs, i);
+                    TREE_GET_BIT(probs, i);
+                    i -= 0x40;
+                };
+#endif
 
-                    auto UPDATE_1 = [&](Prob* x)
+                // dist may be a bad distance that isn't checked yet: it is clamped to the bytes in the dictionary,
+                // so that the address stays in it
+                auto prefetchMatch = [&](UInt32 dist) LZMA_FORCEINLINE
+                {
+                    if (Traits::prefetch)
                     {
-                        range -= bound;
-                        code -= bound;
-                        *x = (Prob)(ttt - (ttt >> kNumMoveBits));
-                    };
+                        std::size_t reach = (checkDicSize == 0) ? processedPos : checkDicSize;
+                        std::size_t held = Window::wraps ? dicBufSize : dicPos;
+                        if (reach > held)
+                            reach = held;
 
-    #define LZMA_DECODER_DETAILS_GET_BIT2_(x, i, A0, A1) if (isBit0(x)) { UPDATE_0(x); i = (i + i); A0; } else { UPDATE_1(x); i = (i + i) + 1; A1; }
+                        LZMA_PREFETCH(dic + dicPosBack(dist < reach ? dist : (UInt32)reach));
+                    }
+                };
 
-                    auto GET_BIT = [&](Prob* x, unsigned& i)
+                // called after a byte is written: the previous byte and position pick the literal probabilities
+                auto prefetchLiteral = [&]() LZMA_FORCEINLINE
+                {
+                    if (Traits::prefetch)
+                        LZMA_PREFETCH(probs + Literal + LZMA_LIT_SIZE * (((processedPos & lpMask) << lc) + (dic[dicPos - 1] >> (8 - lc))));
+                };
+
+                auto prob = probs + IsMatch + StateRow(state) + posState;
+                if (isBit0(prob))
+                {
+                    unsigned symbol;
+                    auto matchedLiteral = (state >= kNumLitStates);
+                    UPDATE_0(prob);
+                    prob = probs + Literal;
+                    if (checkDicSize != 0 || processedPos != 0)
                     {
-                        LZMA_DECODER_DETAILS_GET_BIT2_(x, i, ; , ;)
-                    };
+                        tracker.OnRead(dicPosBack(1), (0xFF00u >> lc) & 0xFF);
+                        prob += (LZMA_LIT_SIZE * (((processedPos & lpMask) << lc) +
+                        (dic[dicPosBack(1)] >> (8 - lc))));
+                    }
 
-                    auto TREE_GET_BIT = [&](Prob* probs, unsigned& i) { GET_BIT(probs + i, i); };
-                    auto TREE_DECODE = [&](Prob* probs, unsigned limit, unsigned& i)
+                    if (state < kNumLitStates)
                     {
-                        i = 1;
+                        state -= (state < 4) ? state : 3;
+                        symbol = 1;
                         do
                         {
-                            TREE_GET_BIT(probs, i);
+                            GET_BIT(prob + symbol, symbol);
                         }
-                        while (i < limit);
-                        i -= limit;
-                    };
-
-                    // #define _LZMA_SIZE_OPT
-    #ifdef _LZMA_SIZE_OPT
-                    auto TREE_6_DECODE = [&](Prob* probs, unsigned& i) { TREE_DECODE(probs, (1 << 6), i); };
-    #else
-                    auto TREE_6_DECODE = [&](Prob* probs, unsigned& i)
-                    {
-                        i = 1;
-                        TREE_GET_BIT(probs, i);
-                        TREE_GET_BIT(probs, i);
-                        TREE_GET_BIT(probs, i);
-                        TREE_GET_BIT(probs, i);
-                        TREE_GET_BIT(probs, i);
-                        TREE_GET_BIT(probs, i);
-                        i -= 0x40;
-                    };
-    #endif
-
-                    auto prob = probs + IsMatch + (state << kNumPosBitsMax) + posState;
-                    if (isBit0(prob))
+                        while (symbol < 0x100);
+                    }
+                    else
                     {
-                        unsigned symbol;
-                        UPDATE_0(prob);
-                        prob = probs + Literal;
-                        if (checkDicSize != 0 || processedPos != 0)
-                            prob += (LZMA_LIT_SIZE * (((processedPos & lpMask) << lc) +
-                            (dic[(dicPos == 0 ? dicBufSize : dicPos) - 1] >> (8 - lc))));
-
-                        if (state < kNumLitStates)
+                        tracker.OnRead(dicPosBack(rep0), 0xFF);
+                        unsigned matchByte = dic[dicPosBack(rep0)];
+                        unsigned offs = 0x100;
+                        state -= (state < 10) ? 3 : 6;
+                        symbol = 1;
+                        do
                         {
-                            state -= (state < 4) ? state : 3;
-                            symbol = 1;
-                            do
+                            unsigned bit;
+                            Prob *probLit;
+                            matchByte <<= 1;
+                            bit = (matchByte & offs);
+                            probLit = prob + offs + bit + symbol;
+                            if (Traits::branchlessTrees)
                             {
-                                GET_BIT(prob + symbol, symbol);
+                                auto b = bitNoBranch(probLit);
+                                symbol = (symbol + symbol) + b;
+                                offs &= ~(bit ^ (0u - b)); // b ? bit : ~bit, without a branch
                             }
-                            while (symbol < 0x100);
-                        }
-                        else
-                        {
-                            unsigned matchByte = m_dic.mem[(dicPos - rep0) + ((dicPos < rep0) ? dicBufSize : 0)];
-                            unsigned offs = 0x100;
-                            state -= (state < 10) ? 3 : 6;
-                            symbol = 1;
-                            do
+                            else
                             {
-                                unsigned bit;
-                                Prob *probLit;
-                                matchByte <<= 1;
-                                bit = (matchByte & offs);
-                                probLit = prob + offs + bit + symbol;
                                 LZMA_DECODER_DETAILS_GET_BIT2_(probLit, symbol, offs &= ~bit, offs &= bit)
                             }
-                            while (symbol < 0x100);
                         }
-                        dic[dicPos++] = (Byte)symbol;
-                        processedPos++;
-                        continue;
+                        while (symbol < 0x100);
+                    }
+
+                    if (!symbolFits())
+                        return false;
+
+                    if (Checked && dicPos >= limit)
+                        throw BadStream(); // only the end mark may follow the output limit
+
+                    dic[dicPos++] = (Byte)symbol;
+                    processedPos++;
+                    stats.OnLiteral(matchedLiteral);
+                    prefetchLiteral();
+                    return true;
+                }
+                else
+                {
+                    UPDATE_1(prob);
+                    prob = probs + IsRep + StateCol(state);
+                    if (isBit0(prob))
+                    {
+                        UPDATE_0(prob);
+                        state += kNumStates;
+                        prob = probs + LenCoder;
                     }
                     else
                     {
                         UPDATE_1(prob);
-                        prob = probs + IsRep + state;
+                        if (checkDicSize == 0 && processedPos == 0)
+                        {
+                            if (!symbolFits())
+                                return false;
+
+                            throw BadStream();
+                        }
+
+                        prob = probs + IsRepG0 + StateCol(state);
                         if (isBit0(prob))
                         {
                             UPDATE_0(prob);
-                            state += kNumStates;
-                            prob = probs + LenCoder;
+                            prob = probs + IsRep0Long + StateRow(state) + posState;
+                            if (isBit0(prob))
+                            {
+                                UPDATE_0(prob);
+
+                                if (!symbolFits())
+                                    return false;
+
+                                if (Checked && dicPos >= limit)
+                                    throw BadStream();
+
+                                tracker.OnCopy(dicPos, dicPosBack(rep0), 1);
+                                dic[dicPos] = dic[dicPosBack(rep0)];
+                                dicPos++;
+                                processedPos++;
+                                stats.OnShortRep();
+                                prefetchLiteral();
+                                state = state < kNumLitStates ? 9 : 11;
+                                return true;
+                            }
+                            UPDATE_1(prob);
+                            repIndex = 0;
                         }
                         else
                         {
+                            UInt32 distance;
                             UPDATE_1(prob);
-                            if (checkDicSize == 0 && processedPos == 0)
-                                throw BadStream();
-
-                            prob = probs + IsRepG0 + state;
+                            prob = probs + IsRepG1 + StateCol(state);
                             if (isBit0(prob))
                             {
                                 UPDATE_0(prob);
-                                prob = probs + IsRep0Long + (state << kNumPosBitsMax) + posState;
-                                if (isBit0(prob))
-                                {
-                                    UPDATE_0(prob);
-                                    dic[dicPos] = dic[(dicPos - rep0) + ((dicPos < rep0) ? dicBufSize : 0)];
-                                    dicPos++;
-                                    processedPos++;
-                                    state = state < kNumLitStates ? 9 : 11;
-                                    continue;
-                                }
-                                UPDATE_1(prob);
+                                distance = rep1;
+                                repIndex = 1;
                             }
                             else
                             {
-                                UInt32 distance;
                                 UPDATE_1(prob);
-                                prob = probs + IsRepG1 + state;
+                                prob = probs + IsRepG2 + StateCol(state);
                                 if (isBit0(prob))
                                 {
                                     UPDATE_0(prob);
-                                    distance = rep1;
+                                    distance = rep2;
+                                    repIndex = 2;
                                 }
                                 else
                                 {
                                     UPDATE_1(prob);
-                                    prob = probs + IsRepG2 + state;
-                                    if (isBit0(prob))
-                                    {
-                                        UPDATE_0(prob);
-                                        distance = rep2;
-                                    }
-                                    else
-                                    {
-                                        UPDATE_1(prob);
-                                        distance = rep3;
-                                        rep3 = rep2;
-                                    }
-                                    rep2 = rep1;
+                                    distance = rep3;
+                                    repIndex = 3;
+                                    rep3 = rep2;
                                 }
-                                rep1 = rep0;
-                                rep0 = distance;
+                                rep2 = rep1;
                             }
-                            state = state < kNumLitStates ? 8 : 11;
-                            prob = probs + RepLenCoder;
+                            rep1 = rep0;
+                            rep0 = distance;
+                        }
+                        prefetchMatch(rep0);
+                        state = state < kNumLitStates ? 8 : 11;
+                        prob = probs + RepLenCoder;
+                    }
+                    {
+                        unsigned limit, offset;
+                        Prob *probLen = prob + LenChoice;
+                        if (isBit0(probLen))
+                        {
+                            UPDATE_0(probLen);
+                            probLen = prob + LenLow + (posState << kLenNumLowBits);
+                            offset = 0;
+                            limit = (1 << kLenNumLowBits);
                         }
+                        else
                         {
-                            unsigned limit, offset;
-                            Prob *probLen = prob + LenChoice;
+                            UPDATE_1(probLen);
+                            probLen = prob + LenChoice2;
                             if (isBit0(probLen))
                             {
                                 UPDATE_0(probLen);
-                                probLen = prob + LenLow + (posState << kLenNumLowBits);
-                                offset = 0;
-                                limit = (1 << kLenNumLowBits);
+                                probLen = prob + LenMid + (posState << kLenNumMidBits);
+                                offset = kLenNumLowSymbols;
+                                limit = (1 << kLenNumMidBits);
                             }
                             else
                             {
                                 UPDATE_1(probLen);
-                                probLen = prob + LenChoice2;
-                                if (isBit0(probLen))
-                                {
-                                    UPDATE_0(probLen);
-                                    probLen = prob + LenMid + (posState << kLenNumMidBits);
-                                    offset = kLenNumLowSymbols;
-                                    limit = (1 << kLenNumMidBits);
-                                }
-                                else
-                                {
-                                    UPDATE_1(probLen);
-                                    probLen = prob + LenHigh;
-                                    offset = kLenNumLowSymbols + kLenNumMidSymbols;
-                                    limit = (1 << kLenNumHighBits);
-                                }
+                                probLen = prob + LenHigh;
+                                offset = kLenNumLowSymbols + kLenNumMidSymbols;
+                                limit = (1 << kLenNumHighBits);
                             }
-                            TREE_DECODE(probLen, limit, len);
-                            len += offset;
                         }
+                        TREE_DECODE(probLen, limit, len);
+                        len += offset;
+                    }
 
-                        if (state >= kNumStates)
+                    if (state >= kNumStates)
+                    {
+                        UInt32 distance;
+                        prob = probs + PosSlot +
+                            ((len < kNumLenToPosStates ? len : kNumLenToPosStates - 1) << kNumPosSlotBits);
+                        TREE_6_DECODE(prob, distance);
+                        if (distance >= kStartPosModelIndex)
                         {
-                            UInt32 distance;
-                            prob = probs + PosSlot +
-                                ((len < kNumLenToPosStates ? len : kNumLenToPosStates - 1) << kNumPosSlotBits);
-                            TREE_6_DECODE(prob, distance);
-                            if (distance >= kStartPosModelIndex)
+                            unsigned posSlot = (unsigned)distance;
+                            int numDirectBits = (int)(((distance >> 1) - 1));
+                            distance = (2 | (distance & 1));
+                            if (posSlot < kEndPosModelIndex)
                             {
-                                unsigned posSlot = (unsigned)distance;
-                                int numDirectBits = (int)(((distance >> 1) - 1));
-                                distance = (2 | (distance & 1));
-                                if (posSlot < kEndPosModelIndex)
+                                distance <<= numDirectBits;
+                                prob = probs + SpecPos + distance - posSlot - 1;
                                 {
-                                    distance <<= numDirectBits;
-                                    prob = probs + SpecPos + distance - posSlot - 1;
+                                    UInt32 mask = 1;
+                                    unsigned i = 1;
+                                    do
                                     {
-                                        UInt32 mask = 1;
-                                        unsigned i = 1;
-                                        do
+                                        if (Traits::branchlessTrees)
+                                        {
+                                            auto b = bitNoBranch(prob + i);
+                                            i = (i + i) + b;
+                                            distance |= mask & (0u - b);
+                                        }
+                                        else
                                         {
                                             LZMA_DECODER_DETAILS_GET_BIT2_(prob + i, i, ; , distance |= mask);
-                                            mask <<= 1;
                                         }
-                                        while (--numDirectBits != 0);
+                                        mask <<= 1;
                                     }
+                                    while (--numDirectBits != 0);
                                 }
-                                else
+                            }
+                            else
+                            {
+                                numDirectBits -= kNumAlignBits;
+                                do
                                 {
-                                    numDirectBits -= kNumAlignBits;
-                                    do
+                                    distance = (distance << 1) + rc.DirectBit();
+                                }
+                                while (--numDirectBits != 0);
+                                prob = probs + Align;
+                                distance <<= kNumAlignBits;
+                                prefetchMatch(distance + kAlignTableSize); // the align bits move the source by less than that
+                                {
+                                    unsigned i = 1;
+                                    if (Traits::branchlessTrees)
                                     {
-                                        NORMALIZE();
-                                        range >>= 1;
-
-                                        {
-                                            UInt32 t;
-                                            code -= range;
-                                            t = (0 - ((UInt32)code >> 31)); /* (UInt32)((Int32)code >> 31) */
-                                            distance = (distance << 1) + (t + 1);
-                                            code += range & t;
-                                        }
-                                        /*
-                                        distance <<= 1;
-                                        if (code >= range)
+                                        for (UInt32 mask = 1; mask != kAlignTableSize; mask <<= 1)
                                         {
-                                        code -= range;
-                                        distance |= 1;
+                                            auto b = bitNoBranch(prob + i);
+                                            i = (i + i) + b;
+                                            distance |= mask & (0u - b);
                                         }
-                                        */
                                     }
-                                    while (--numDirectBits != 0);
-                                    prob = probs + Align;
-                                    distance <<= kNumAlignBits;
+                                    else
                                     {
-                                        unsigned i = 1;
                                         LZMA_DECODER_DETAILS_GET_BIT2_(prob + i, i, ; , distance |= 1);
                                         LZMA_DECODER_DETAILS_GET_BIT2_(prob + i, i, ; , distance |= 2);
                                         LZMA_DECODER_DETAILS_GET_BIT2_(prob + i, i, ; , distance |= 4);
                                         LZMA_DECODER_DETAILS_GET_BIT2_(prob + i, i, ; , distance |= 8);
                                     }
-                                    if (distance == (UInt32)0xFFFFFFFF)
-                                    {
-                                        len += kMatchSpecLenStart;
-                                        state -= kNumStates;
-                                        break;
-                                    }
                                 }
                             }
-                            rep3 = rep2;
-                            rep2 = rep1;
-                            rep1 = rep0;
-                            rep0 = distance + 1;
-                        
-                            if (checkDicSize == 0)
-                            {
-                                if (distance >= processedPos)
-                                    throw BadStream();
-                            }
-                            else if (distance >= checkDicSize)
-                            {
-                                throw BadStream();
-                            }
-
-                            state = (state < kNumStates + kNumLitStates) ? kNumLitStates : kNumLitStates + 3;
                         }
 
-                        len += kMatchMinLen;
+                        if (!symbolFits())
+                            return false;
 
-                        if (limit == dicPos)
-                            throw BadStream();
+                        if (distance == (UInt32)0xFFFFFFFF)
+                        {
+                            len += kMatchSpecLenStart;
+                            state -= kNumStates;
+                            return false;
+                        }
 
+                        rep3 = rep2;
+                        rep2 = rep1;
+                        rep1 = rep0;
+                        rep0 = distance + 1;
+                    
+                        if (checkDicSize == 0)
+                        {
+                            if (distance >= processedPos)
+                                throw BadStream();
+                        }
+                        else if (distance >= checkDicSize)
                         {
-                            auto rem = limit - dicPos;
-                            auto curLen = ((rem < len) ? (unsigned)rem : len);
-                            auto pos = (dicPos - rep0) + ((dicPos < rep0) ? dicBufSize : 0);
+                            throw BadStream();
+                        }
 
-                            processedPos += curLen;
+                        state = (state < kNumStates + kNumLitStates) ? kNumLitStates : kNumLitStates + 3;
+                    }
+                    else if (!symbolFits())
+                    {
+                        return false;
+                    }
 
-                            len -= curLen;
-                            if (pos + curLen <= dicBufSize)
-                            {
-                                Byte *dest = dic + dicPos;
-                                ptrdiff_t src = (ptrdiff_t)pos - (ptrdiff_t)dicPos;
-                                const Byte *lim = dest + curLen;
-                                dicPos += curLen;
+                    len += kMatchMinLen;
 
-                                do
-                                {
-                                    *(dest) = (Byte)*(dest + src);
-                                }
-                                while (++dest != lim);
-                            }
-                            else
+                    if (repIndex < 0)
+                        stats.OnMatch(len);
+                    else
+                        stats.OnRep(repIndex, len);
+
+                    if (limit == dicPos)
+                        throw BadStream();
+
+                    {
+                        auto rem = limit - dicPos;
+                        auto curLen = ((rem < len) ? (unsigned)rem : len);
+                        auto pos = dicPosBack(rep0);
+
+                        processedPos += curLen;
+                        tracker.OnCopy(dicPos, pos, curLen);
+
+                        len -= curLen;
+                        if (!Window::wraps || pos + curLen <= dicBufSize)
+                        {
+                            CopyMatch(dic + dicPos, dic + pos, curLen);
+                            dicPos += curLen;
+                        }
+                        else
+                        {
+                            do
                             {
-                                do
-                                {
-                                    dic[dicPos++] = dic[pos];
-                                    if (++pos == dicBufSize)
-                                        pos = 0;
-                                }
-                                while (--curLen != 0);
+                                dic[dicPos++] = dic[pos];
+                                if (++pos == dicBufSize)
+                                    pos = 0;
                             }
+                            while (--curLen != 0);
                         }
+
+                        prefetchLiteral();
                     }
                 }
-                while (dicPos < limit && buf < bufLimit);
-                NORMALIZE();
-                this->buf = buf;
-                this->m_range = range;
-                this->m_code = code;
-                this->remainLen = len;
-                m_dic.pos = dicPos;
-                this->processedPos = processedPos;
-                this->reps[0] = rep0;
-                this->reps[1] = rep1;
-                this->reps[2] = rep2;
-                this->reps[3] = rep3;
-                this->state = state;
+
+                return true;
 
     #undef LZMA_DECODER_DETAILS_GET_BIT2_
             }
 
+#if defined(LZMA_CPU_DISPATCH)
+            // The same functions built for AVX2 + BMI2; flatten inlines the loop, its helpers and CopyMatch into them.
+            template<int LC, int LP, int PB, bool Checked>
+            LZMA_TARGET_AVX2 bool DecodeRealAvx2(std::size_t limit, const Byte *bufLimit)
+            {
+                return DecodeReal<LC, LP, PB, Checked>(limit, bufLimit);
+            }
+
+            LZMA_TARGET_AVX2 void WriteRemAvx2(std::size_t limit)
+            {
+                WriteRem(limit);
+            }
+#endif
+
             void WriteRem(std::size_t limit)
             {
                 if (this->remainLen != 0 && this->remainLen < kMatchSpecLenStart)
@@ -795,271 +1756,26 @@ namespace lzma
 
                     this->processedPos += len;
                     this->remainLen -= len;
-                    while (len-- != 0)
-                    {
-                        dic[dicPos] = dic[(dicPos - rep0) + ((dicPos < rep0) ? dicBufSize : 0)];
-                        dicPos++;
-                    }
-
-                    m_dic.pos = dicPos;
-                }
-            }
-
-            enum Dummy
-            {
-                DUMMY_ERROR, /* unexpected end of input stream */
-                DUMMY_LIT,
-                DUMMY_MATCH,
-                DUMMY_REP
-            };
 
-            Dummy TryDummy(const Byte *buf, std::size_t inSize)
-            {
-                auto range = this->m_range;
-                auto code = this->m_code;
-                auto bufLimit = buf + inSize;
-                auto probs = m_probs;
-                auto state = this->state;
-                Dummy res;
-
-                auto NORMALIZE_CHECK = [&]() -> bool
-                {
-                    if (range < kTopValue)
+                    auto pos = (dicPos - rep0) + ((Window::wraps && dicPos < rep0) ? dicBufSize : 0);
+                    m_tracker.OnCopy(dicPos, pos, len);
+                    if (!Window::wraps || pos + len <= dicBufSize)
                     {
-                        if (buf >= bufLimit)
-                            return false;
-
-                        range <<= 8;
-                        code = (code << 8) | (*buf++);
-                    }
-
-                    return true;
-                };
-
-                {
-                    UInt32 bound;
-                    unsigned ttt;
-                    unsigned posState = (this->processedPos) & ((1 << m_properties.pb) - 1);
-
-                    auto UPDATE_0_CHECK = [&]{ range = bound; };
-                    auto UPDATE_1_CHECK = [&]{ range -= bound; code -= bound; };
-
-                    auto bit0Check = [&](Prob* x) -> bool
-                    {
-                        ttt = *x;
-                        bound = (range >> kNumBitModelTotalBits) * ttt;
-                        return code < bound;
-                    };
-
-    #define LZMA_DECODER_DETAILS_GET_BIT2_CHECK_(x, i, A0, A1) \
-        if (bit0Check(x)) { UPDATE_0_CHECK(); i = (i + i); A0; } else { UPDATE_1_CHECK(); i = (i + i) + 1; A1; }
-
-                    auto GET_BIT_CHECK = [&](Prob* x, unsigned& i)
-                    {
-                        LZMA_DECODER_DETAILS_GET_BIT2_CHECK_(x, i, ; , ;)
-                    };
-
-    #define LZMA_DECODER_DETAILS_TREE_DECODE_CHECK_(probs, limit, i) \
-                    { i = 1; do { if (!NORMALIZE_CHECK()) return DUMMY_ERROR; GET_BIT_CHECK(probs + i, i); } while (i < limit); i -= limit; }
-
-                    auto prob = probs + IsMatch + (state << kNumPosBitsMax) + posState;
-                    if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                    if (bit0Check(prob))
-                    {
-                        UPDATE_0_CHECK();
-
-                        /* if (bufLimit - buf >= 7) return DUMMY_LIT; */
-
-                        prob = probs + Literal;
-                        if (this->checkDicSize != 0 || this->processedPos != 0)
-                            prob += (LZMA_LIT_SIZE *
-                            ((((this->processedPos) & ((1 << (m_properties.lp)) - 1)) << m_properties.lc) +
-                            (m_dic.mem[(m_dic.pos == 0 ? m_dic.size : m_dic.pos) - 1] >> (8 - m_properties.lc))));
-
-                        if (state < kNumLitStates)
-                        {
-                            unsigned symbol = 1;
-                            do
-                            {
-                                if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                GET_BIT_CHECK(prob + symbol, symbol);
-                            }
-                            while (symbol < 0x100);
-                        }
-                        else
-                        {
-                            unsigned matchByte = m_dic.mem[m_dic.pos - this->reps[0] +
-                                ((m_dic.pos < this->reps[0]) ? m_dic.size : 0)];
-                            unsigned offs = 0x100;
-                            unsigned symbol = 1;
-                            do
-                            {
-                                unsigned bit;
-                                Prob *probLit;
-                                matchByte <<= 1;
-                                bit = (matchByte & offs);
-                                probLit = prob + offs + bit + symbol;
-                                if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                LZMA_DECODER_DETAILS_GET_BIT2_CHECK_(probLit, symbol, offs &= ~bit, offs &= bit)
-                            }
-                            while (symbol < 0x100);
-                        }
-                        res = DUMMY_LIT;
+                        CopyMatch(dic + dicPos, dic + pos, len);
+                        dicPos += len;
                     }
                     else
                     {
-                        unsigned len;
-                        UPDATE_1_CHECK();
-
-                        prob = probs + IsRep + state;
-                        if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                        if (bit0Check(prob))
-                        {
-                            UPDATE_0_CHECK();
-                            state = 0;
-                            prob = probs + LenCoder;
-                            res = DUMMY_MATCH;
-                        }
-                        else
-                        {
-                            UPDATE_1_CHECK();
-                            res = DUMMY_REP;
-                            prob = probs + IsRepG0 + state;
-                            if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                            if (bit0Check(prob))
-                            {
-                                UPDATE_0_CHECK();
-                                prob = probs + IsRep0Long + (state << kNumPosBitsMax) + posState;
-                                if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                if (bit0Check(prob))
-                                {
-                                    UPDATE_0_CHECK();
-                                    if (!NORMALIZE_CHECK())
-                                        return DUMMY_ERROR;
-
-                                    return DUMMY_REP;
-                                }
-                                else
-                                {
-                                    UPDATE_1_CHECK();
-                                }
-                            }
-                            else
-                            {
-                                UPDATE_1_CHECK();
-                                prob = probs + IsRepG1 + state;
-                                if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                if (bit0Check(prob))
-                                {
-                                    UPDATE_0_CHECK();
-                                }
-                                else
-                                {
-                                    UPDATE_1_CHECK();
-                                    prob = probs + IsRepG2 + state;
-                                    if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                    if (bit0Check(prob))
-                                    {
-                                        UPDATE_0_CHECK();
-                                    }
-                                    else
-                                    {
-                                        UPDATE_1_CHECK();
-                                    }
-                                }
-                            }
-                            state = kNumStates;
-                            prob = probs + RepLenCoder;
-                        }
-                        {
-                            unsigned limit, offset;
-                            Prob *probLen = prob + LenChoice;
-                            if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                            if (bit0Check(probLen))
-                            {
-                                UPDATE_0_CHECK();
-                                probLen = prob + LenLow + (posState << kLenNumLowBits);
-                                offset = 0;
-                                limit = 1 << kLenNumLowBits;
-                            }
-                            else
-                            {
-                                UPDATE_1_CHECK();
-                                probLen = prob + LenChoice2;
-                                if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                if (bit0Check(probLen))
-                                {
-                                    UPDATE_0_CHECK();
-                                    probLen = prob + LenMid + (posState << kLenNumMidBits);
-                                    offset = kLenNumLowSymbols;
-                                    limit = 1 << kLenNumMidBits;
-                                }
-                                else
-                                {
-                                    UPDATE_1_CHECK();
-                                    probLen = prob + LenHigh;
-                                    offset = kLenNumLowSymbols + kLenNumMidSymbols;
-                                    limit = 1 << kLenNumHighBits;
-                                }
-                            }
-                            LZMA_DECODER_DETAILS_TREE_DECODE_CHECK_(probLen, limit, len);
-                            len += offset;
-                        }
-
-                        if (state < 4)
+                        for (; len != 0; --len)
                         {
-                            unsigned posSlot;
-                            prob = probs + PosSlot +
-                                ((len < kNumLenToPosStates ? len : kNumLenToPosStates - 1) <<
-                                kNumPosSlotBits);
-                            LZMA_DECODER_DETAILS_TREE_DECODE_CHECK_(prob, 1 << kNumPosSlotBits, posSlot);
-                            if (posSlot >= kStartPosModelIndex)
-                            {
-                                int numDirectBits = ((posSlot >> 1) - 1);
-
-                                /* if (bufLimit - buf >= 8) return DUMMY_MATCH; */
-
-                                if (posSlot < kEndPosModelIndex)
-                                {
-                                    prob = probs + SpecPos + ((2 | (posSlot & 1)) << numDirectBits) - posSlot - 1;
-                                }
-                                else
-                                {
-                                    numDirectBits -= kNumAlignBits;
-                                    do
-                                    {
-                                        if (!NORMALIZE_CHECK())
-                                            return DUMMY_ERROR;
-
-                                        range >>= 1;
-                                        code -= range & (((code - range) >> 31) - 1);
-                                        /* if (code >= range) code -= range; */
-                                    }
-                                    while (--numDirectBits != 0);
-                                    prob = probs + Align;
-                                    numDirectBits = kNumAlignBits;
-                                }
-                                {
-                                    unsigned i = 1;
-                                    do
-                                    {
-                                        if (!NORMALIZE_CHECK()) return DUMMY_ERROR;
-                                        GET_BIT_CHECK(prob + i, i);
-                                    }
-                                    while (--numDirectBits != 0);
-                                }
-                            }
+                            dic[dicPos++] = dic[pos];
+                            if (++pos == dicBufSize)
+                                pos = 0;
                         }
                     }
-                }
-
-                if (!NORMALIZE_CHECK())
-                    return DUMMY_ERROR;
-
-                return res;
 
-    #undef LZMA_DECODER_DETAILS_GET_BIT2_CHECK_
-    #undef LZMA_DECODER_DETAILS_TREE_DECODE_CHECK_
+                    m_dic.pos = dicPos;
+                }
             }
 
             const Byte *buf;
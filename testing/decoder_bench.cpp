@@ -0,0 +1,411 @@
+// cpp-lzma benchmarks
+// belongs to the public domain
+
+#include <lzma-cpp/Lzma2BatchDecoder.hpp>
+#include <lzma-cpp/Lzma2Decoder.hpp>
+#include <lzma-cpp/Lzma2DecoderPool.hpp>
+#include <lzma-cpp/Lzma2ParallelDecoder.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#   include <linux/perf_event.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#endif
+
+#include "test_data_seq.hpp"
+
+namespace
+{
+    const auto numRuns = 5;
+
+    struct TestFile
+    {
+        std::string name;
+        unsigned prop;
+        std::vector<char> packed;
+        std::size_t unpackedSize;
+    };
+
+    // decodes the whole stream to a flat buffer, like Lzma2Decode
+    template<typename Decoder>
+    void decodeFlat(const TestFile& file, std::vector<lzma::Byte>& out)
+    {
+        Decoder decoder(file.prop);
+        decoder.decoder.m_dic.mem = &out[0];
+        decoder.decoder.m_dic.size = out.size();
+
+        auto srcLen = file.packed.size();
+        lzma::Status status;
+        decoder.DecodeToDic(out.size(), &file.packed[0], srcLen, lzma::FinishMode::End, status);
+
+        if (decoder.decoder.m_dic.pos != file.unpackedSize)
+            throw std::runtime_error("wrong decoded size");
+    }
+
+    // feeds the stream in small blocks, like network reads
+    template<typename Decoder, std::size_t BlockSize>
+    void decodeStreaming(const TestFile& file, std::vector<lzma::Byte>& out)
+    {
+        Decoder decoder(file.prop);
+        decoder.decoder.m_dic.mem = &out[0];
+        decoder.decoder.m_dic.size = out.size();
+
+        lzma::Status status;
+        for (std::size_t pos = 0; pos < file.packed.size(); )
+        {
+            auto srcLen = std::min(BlockSize, file.packed.size() - pos);
+            decoder.DecodeToDic(out.size(), &file.packed[pos], srcLen, lzma::FinishMode::End, status);
+            pos += srcLen;
+        }
+
+        if (decoder.decoder.m_dic.pos != file.unpackedSize)
+            throw std::runtime_error("wrong decoded size");
+    }
+
+    // BufDecoder2 to the caller's buffer, through its own ring dictionary
+    void decodeToBuf(const TestFile& file, std::vector<lzma::Byte>& out)
+    {
+        lzma::BufDecoder2 decoder(file.prop);
+
+        auto destLen = out.size();
+        auto srcLen = file.packed.size();
+        lzma::Status status;
+        decoder.DecodeToBuf(&out[0], destLen, &file.packed[0], srcLen, lzma::FinishMode::End, status);
+
+        if (destLen != file.unpackedSize)
+            throw std::runtime_error("wrong decoded size");
+    }
+
+    // one segment per dictionary reset, on all cores
+    void decodeParallel(const TestFile& file, std::vector<lzma::Byte>& out)
+    {
+        auto outLen = out.size();
+        auto srcLen = file.packed.size();
+        lzma::Lzma2DecodeParallel(&out[0], outLen, &file.packed[0], srcLen, file.prop);
+
+        if (outLen != file.unpackedSize)
+            throw std::runtime_error("wrong decoded size");
+    }
+
+    // guesses the data before state resets, see Lzma2DecodeSpeculative
+    void decodeSpeculative(const TestFile& file, std::vector<lzma::Byte>& out)
+    {
+        auto outLen = out.size();
+        auto srcLen = file.packed.size();
+        lzma::Lzma2DecodeSpeculative(&out[0], outLen, &file.packed[0], srcLen, file.prop);
+
+        if (outLen != file.unpackedSize)
+            throw std::runtime_error("wrong decoded size");
+    }
+
+    template<typename F>
+    void measure(const TestFile& file, const char* variant, F f)
+    {
+        std::vector<lzma::Byte> out(file.unpackedSize);
+        auto best = std::chrono::duration<double>::max();
+
+        for (auto i = 0; i < numRuns; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            f(file, out);
+            best = std::min<std::chrono::duration<double>>(best, std::chrono::steady_clock::now() - start);
+        }
+
+        std::cout << "  " << variant << " : " << (file.unpackedSize / best.count() / (1024 * 1024)) << " MB/s\n";
+    }
+
+    // ScanChunks reads only the chunk headers, so its time depends on the number of chunks
+    void measureScan(const TestFile& file)
+    {
+        auto best = std::chrono::duration<double>::max();
+        std::size_t numChunks = 0;
+
+        for (auto i = 0; i < numRuns; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            numChunks = lzma::ScanChunks(&file.packed[0], file.packed.size()).chunks.size();
+            best = std::min<std::chrono::duration<double>>(best, std::chrono::steady_clock::now() - start);
+        }
+
+        std::cout << "  chunk scan : " << numChunks << " chunks in " << (best.count() * 1e6) << " us\n";
+    }
+
+    // a 4 KB read from the middle of the output, which starts at the dictionary reset before it
+    void measureRange(const TestFile& file)
+    {
+        auto index = lzma::ScanChunks(&file.packed[0], file.packed.size());
+        std::vector<lzma::Byte> out(4096);
+        auto best = std::chrono::duration<double>::max();
+
+        for (auto i = 0; i < numRuns; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            lzma::Lzma2DecodeRange(&out[0], file.unpackedSize / 2, out.size(), &file.packed[0], file.packed.size(), file.prop, index);
+            best = std::min<std::chrono::duration<double>>(best, std::chrono::steady_clock::now() - start);
+        }
+
+        std::cout << "  4 KB range read : " << (best.count() * 1e3) << " ms\n";
+    }
+
+    // the first MB of the stream in 64 KB reads: a new BufDecoder2 allocates its ring and faults its pages in,
+    // a pooled one has them from the stream before
+    void measurePooled(const TestFile& file)
+    {
+        const auto numStreams = 20;
+        const std::size_t outSize = 1024 * 1024, readSize = 64 * 1024;
+        std::vector<lzma::Byte> out(readSize);
+
+        auto decode = [&](lzma::BufDecoder2& decoder)
+        {
+            std::size_t srcPos = 0, total = 0;
+            while (total < outSize)
+            {
+                auto destLen = out.size();
+                auto srcLen = file.packed.size() - srcPos;
+                lzma::Status status;
+                decoder.DecodeToBuf(&out[0], destLen, &file.packed[srcPos], srcLen, lzma::FinishMode::Any, status);
+                srcPos += srcLen;
+                total += destLen;
+            }
+        };
+
+        auto perStream = [&](std::function<void()> f)
+        {
+            auto best = std::chrono::duration<double>::max();
+            for (auto i = 0; i < numRuns; ++i)
+            {
+                auto start = std::chrono::steady_clock::now();
+                for (auto j = 0; j < numStreams; ++j)
+                    f();
+                best = std::min<std::chrono::duration<double>>(best, std::chrono::steady_clock::now() - start);
+            }
+
+            return best.count() * 1e3 / numStreams;
+        };
+
+        auto fresh = perStream([&]{ lzma::BufDecoder2 decoder(file.prop); decode(decoder); });
+        lzma::DecoderPool<lzma::BufDecoder2> pool;
+        auto pooled = perStream([&]{ decode(*pool.Acquire(file.prop)); });
+
+        std::cout << "  first MB in 64 KB reads : new decoder " << fresh << " ms, pooled " << pooled << " ms\n";
+    }
+
+    // L1 data cache read misses of this thread, where the kernel lets us count them
+    class CacheMissCounter
+    {
+    public:
+        CacheMissCounter() : m_fd(-1)
+        {
+#if defined(__linux__)
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            m_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+        }
+
+        ~CacheMissCounter()
+        {
+#if defined(__linux__)
+            if (m_fd >= 0)
+                close(m_fd);
+#endif
+        }
+
+        bool available() const { return m_fd >= 0; }
+
+        unsigned long long read() const
+        {
+            unsigned long long value = 0;
+#if defined(__linux__)
+            if (m_fd >= 0 && ::read(m_fd, &value, sizeof(value)) != sizeof(value))
+                value = 0;
+#endif
+            return value;
+        }
+
+    private:
+        int m_fd;
+    };
+
+    template<typename Decoder>
+    double missesPerSymbol(const TestFile& file, const CacheMissCounter& counter, std::uint64_t symbols)
+    {
+        std::vector<lzma::Byte> out(file.unpackedSize);
+        decodeFlat<Decoder>(file, out); // warm up
+
+        auto start = counter.read();
+        decodeFlat<Decoder>(file, out);
+        return double(counter.read() - start) / symbols;
+    }
+
+    // what the stream is made of, to explain the speed
+    void printStats(const TestFile& file)
+    {
+        std::vector<lzma::Byte> out(file.unpackedSize);
+        lzma::Decoder2Stats decoder(file.prop);
+        decoder.decoder.m_dic.mem = &out[0];
+        decoder.decoder.m_dic.size = out.size();
+
+        auto srcLen = file.packed.size();
+        lzma::Status status;
+        decoder.DecodeToDic(out.size(), &file.packed[0], srcLen, lzma::FinishMode::End, status);
+
+        auto& stats = decoder.GetStats();
+        std::cout << "  literals " << stats.literals << " + " << stats.matchedLiterals << " matched, short reps " << stats.shortReps
+            << ", matches " << stats.matches << ", reps " << stats.reps[0] << "/" << stats.reps[1] << "/" << stats.reps[2] << "/" << stats.reps[3]
+            << ", match bytes " << stats.matchBytes << ", stored bytes " << stats.storedBytes << "\n";
+
+        auto symbols = stats.literals + stats.matchedLiterals + stats.shortReps + stats.matches
+            + stats.reps[0] + stats.reps[1] + stats.reps[2] + stats.reps[3];
+
+        CacheMissCounter counter;
+        if (!counter.available() || symbols == 0)
+        {
+            std::cout << "  L1D misses per symbol : n/a (no hardware counters)\n";
+            return;
+        }
+
+        std::cout << "  L1D misses per symbol : SDK layout " << missesPerSymbol<lzma::Decoder2>(file, counter, symbols)
+            << ", grouped " << missesPerSymbol<lzma::Decoder2GroupedProbs>(file, counter, symbols) << "\n";
+    }
+
+    // the segments between dictionary resets as streams of their own: one by one, and in batches of 1 to 8 lanes
+    void measureBatch(const TestFile& file)
+    {
+        auto index = lzma::ScanChunks(&file.packed[0], file.packed.size());
+        auto segments = lzma::SplitAtDicResets(index);
+        if (segments.size() < 2)
+            return;
+
+        std::vector<std::vector<char>> streams;
+        std::vector<std::vector<lzma::Byte>> outs;
+        for (auto& segment : segments)
+        {
+            auto& first = index.chunks[segment.firstChunk];
+            auto& last = index.chunks[segment.firstChunk + segment.numChunks - 1];
+            streams.emplace_back(file.packed.begin() + first.packedOffset, file.packed.begin() + last.packedOffset + last.packedSize);
+            streams.back().push_back(0);
+            outs.emplace_back(last.unpackedOffset + last.unpackedSize - first.unpackedOffset);
+        }
+
+        auto speed = [&](std::function<void(std::vector<lzma::BatchItem>&)> f)
+        {
+            auto best = std::chrono::duration<double>::max();
+            for (auto i = 0; i < numRuns; ++i)
+            {
+                std::vector<lzma::BatchItem> items;
+                for (std::size_t j = 0; j != streams.size(); ++j)
+                {
+                    lzma::BatchItem item = { &streams[j][0], streams[j].size(), &outs[j][0], outs[j].size(), file.prop, lzma::Status::NotSpecified, false };
+                    items.push_back(item);
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                f(items);
+                best = std::min<std::chrono::duration<double>>(best, std::chrono::steady_clock::now() - start);
+
+                for (auto& item : items)
+                {
+                    if (item.bad || item.status != lzma::Status::FinishedWithMark)
+                        throw std::runtime_error("a stream of the batch is not decoded");
+                }
+            }
+
+            return file.unpackedSize / best.count() / (1024 * 1024);
+        };
+
+        auto oneByOne = speed([](std::vector<lzma::BatchItem>& items)
+        {
+            for (auto& item : items)
+                lzma::Lzma2Decode(item.dest, item.destLen, item.src, item.srcLen, item.prop, lzma::FinishMode::End, item.status);
+        });
+
+        auto lanes = [](std::vector<lzma::BatchItem>& items, std::size_t numLanes)
+        {
+            switch (numLanes)
+            {
+            case 1: lzma::Lzma2DecodeBatch<1>(&items[0], items.size()); break;
+            case 2: lzma::Lzma2DecodeBatch<2>(&items[0], items.size()); break;
+            case 4: lzma::Lzma2DecodeBatch<4>(&items[0], items.size()); break;
+            default: lzma::Lzma2DecodeBatch<8>(&items[0], items.size()); break;
+            }
+        };
+
+        std::cout << "  " << streams.size() << " streams : one by one " << oneByOne << " MB/s, batch of";
+        for (std::size_t numLanes = 1; numLanes <= 8; numLanes *= 2)
+            std::cout << " " << numLanes << ": " << speed([&](std::vector<lzma::BatchItem>& items){ lanes(items, numLanes); });
+        std::cout << " MB/s\n";
+    }
+
+    struct FileCollector
+    {
+        std::vector<TestFile> files;
+
+        template<typename SeqGen>
+        void operator()(std::string testName, SeqGen&& seqGen)
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file " + testName + ".lzma2");
+
+            TestFile file;
+            file.name = testName;
+            file.prop = ifs.get();
+            file.packed.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+            file.unpackedSize = seqGen.seq_len;
+            files.push_back(std::move(file));
+        }
+    };
+}
+
+int main()
+{
+    try
+    {
+        FileCollector collector;
+        run_tests(collector);
+
+        for (auto& file : collector.files)
+        {
+            if (file.unpackedSize < 1024 * 1024)
+                continue;
+
+            std::cout << file.name << " (" << file.packed.size() << " -> " << file.unpackedSize << " bytes)\n";
+            printStats(file);
+            measureScan(file);
+            measureRange(file);
+            measurePooled(file);
+            measureBatch(file);
+            measure(file, "16-bit probs", decodeFlat<lzma::Decoder2>);
+            measure(file, "32-bit probs", decodeFlat<lzma::Decoder2Prob32>);
+            measure(file, "linear window", decodeFlat<lzma::LinearDecoder2>);
+            measure(file, "wide range coder", decodeFlat<lzma::Decoder2WideRc>);
+            measure(file, "prefetch", decodeFlat<lzma::Decoder2Prefetch>);
+            measure(file, "branchless trees", decodeFlat<lzma::Decoder2Branchless>);
+            measure(file, "grouped probs", decodeFlat<lzma::Decoder2GroupedProbs>);
+            measure(file, "1460-byte reads", decodeStreaming<lzma::Decoder2, 1460>);
+            measure(file, "BufDecoder2", decodeToBuf);
+            measure(file, "all cores", decodeParallel);
+            measure(file, "all cores, speculative", decodeSpeculative);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -1,21 +1,54 @@
 // cpp-lzma tests
 // belongs to the public domain
 
+#include <lzma-cpp/Lzma2BatchDecoder.hpp>
+#include <lzma-cpp/Lzma2Checkpoints.hpp>
 #include <lzma-cpp/Lzma2Decoder.hpp>
+#include <lzma-cpp/Lzma2DecoderPool.hpp>
+#include <lzma-cpp/Lzma2ParallelDecoder.hpp>
 
-#include <cassert>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "test_data_seq.hpp"
 
+// the baseline build of the decoding loop, the one CPUs without AVX2 run
+struct BaselineCpuTraits : lzma::DefaultTraits
+{
+    static const bool cpuDispatch = false;
+};
+
+inline void checkStats(const lzma::NoStats&, std::size_t) {}
+
+// every output byte comes from exactly one counted symbol
+inline void checkStats(const lzma::SymbolStats& stats, std::size_t outSize)
+{
+    std::uint64_t lengths = 0, reps = 0;
+    for (auto n : stats.matchLengths)
+        lengths += n;
+    for (auto n : stats.reps)
+        reps += n;
+
+    if (stats.literals + stats.matchedLiterals + stats.shortReps + stats.matchBytes + stats.storedBytes != outSize || lengths != stats.matches + reps)
+        throw std::runtime_error("stats don't add up");
+}
+
+template<typename Decoder>
 struct Tester
 {
-    static const auto inBufSize = 4096u;
-    char inBuf[inBufSize];
+    // small blocks make symbols straddle the block ends
+    explicit Tester(unsigned blockSize = 4096) : inBufSize(blockSize), inBuf(blockSize) {}
+
+    unsigned inBufSize;
+    std::vector<char> inBuf;
 
     template<typename SeqGen>
     void operator()(std::string testName, SeqGen&& seqGen)
@@ -29,7 +62,7 @@ struct Tester
                 throw std::runtime_error("can't open file");
 
             auto prop = ifs.get();
-            lzma::Decoder2 decoder(prop);
+            Decoder decoder(prop);
             
             std::vector<lzma::Byte> dict(decoder.decoder.m_properties.dicSize);
             decoder.decoder.m_dic.mem = &dict[0];
@@ -37,6 +70,7 @@ struct Tester
             
             auto inLen = 0u;
             auto inPos = 0u;
+            std::size_t totalOut = 0;
 
             lzma::Status status;
 
@@ -44,7 +78,7 @@ struct Tester
             {
                 if (inPos == inLen)
                 {
-                    ifs.read(inBuf, inBufSize);
+                    ifs.read(&inBuf[0], inBufSize);
                     inPos = 0;
                     inLen = (unsigned)ifs.gcount();
                 }
@@ -55,14 +89,15 @@ struct Tester
                 auto oldPos = decoder.decoder.m_dic.pos;
 
                 std::size_t srcLen = inLen - inPos;
-                decoder.DecodeToDic(decoder.decoder.m_dic.size, inBuf + inPos, srcLen, lzma::FinishMode::Any, status);
+                decoder.DecodeToDic(decoder.decoder.m_dic.size, &inBuf[inPos], srcLen, lzma::FinishMode::Any, status);
                 
                 inPos += srcLen;
                 auto outLen = decoder.decoder.m_dic.pos - oldPos;
 
                 seqGen.compare(decoder.decoder.m_dic.mem + oldPos, outLen);
+                totalOut += outLen;
 
-                if (inLen == 0 || outLen == 0)
+                if (inLen == 0 || (srcLen == 0 && outLen == 0))
                     break;
             }
 
@@ -71,6 +106,370 @@ struct Tester
 
             if (status == lzma::Status::NeedsMoreInput)
                 throw std::runtime_error("incomplete stream");
+
+            checkStats(decoder.GetStats(), totalOut);
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what()  << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
+// decodes through BufDecoder2, whose output blocks cut stored and LZMA chunks at any byte;
+// the calls take turns with the output block sizes
+template<typename Decoder>
+struct BufTester
+{
+    // hintDivisor - if not 0, the decoder gets the output size divided by it as a size hint
+    BufTester(std::size_t inBlockSize, std::vector<std::size_t> outBlockSizes, std::size_t hintDivisor = 0)
+        : inBlockSize(inBlockSize), outBlockSizes(outBlockSizes), hintDivisor(hintDivisor) {}
+
+    std::size_t inBlockSize;
+    std::vector<std::size_t> outBlockSizes;
+    std::size_t hintDivisor;
+
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            auto prop = ifs.get();
+            std::unique_ptr<Decoder> decoderPtr(hintDivisor == 0 ? new Decoder(prop) : new Decoder(prop, seqGen.seq_len / hintDivisor));
+            auto& decoder = *decoderPtr;
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+            std::vector<lzma::Byte> out(*std::max_element(outBlockSizes.begin(), outBlockSizes.end()));
+            std::size_t inPos = 0, totalOut = 0;
+
+            lzma::Status status;
+            for (std::size_t call = 0; ; ++call)
+            {
+                auto srcLen = std::min(inBlockSize, packed.size() - inPos);
+                auto destLen = outBlockSizes[call % outBlockSizes.size()];
+                decoder.DecodeToBuf(&out[0], destLen, &packed[inPos], srcLen, lzma::FinishMode::Any, status);
+
+                inPos += srcLen;
+                seqGen.compare(&out[0], destLen);
+                totalOut += destLen;
+
+                if (status == lzma::Status::FinishedWithMark || (srcLen == 0 && destLen == 0))
+                    break;
+            }
+
+            if (!seqGen.empty())
+                throw std::runtime_error("stream is too short");
+
+            if (status != lzma::Status::FinishedWithMark)
+                throw std::runtime_error("incomplete stream");
+
+            // the ring grows with the output
+            if (decoder.GetDicBufSize() > std::max<std::size_t>(2 * totalOut, 4096))
+                throw std::runtime_error("dictionary buffer is too big");
+
+            checkStats(decoder.GetStats(), totalOut);
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what()  << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
+// indexes each file with ScanChunks
+struct ScanTester
+{
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            ifs.get();
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+            auto index = lzma::ScanChunks(&packed[0], packed.size());
+            if (index.unpackedSize != seqGen.seq_len || index.packedSize != packed.size())
+                throw std::runtime_error("wrong stream size");
+
+            std::uint64_t packedPos = 0, unpackedPos = 0, dicResets = 0;
+            for (auto& chunk : index.chunks)
+            {
+                if (chunk.packedOffset != packedPos || chunk.unpackedOffset != unpackedPos)
+                    throw std::runtime_error("chunks are not contiguous");
+
+                packedPos += chunk.packedSize;
+                unpackedPos += chunk.unpackedSize;
+                dicResets += chunk.resetsDic;
+            }
+
+            auto interval = seqGen.reset_interval;
+            if (interval != 0 && dicResets != (seqGen.seq_len + interval - 1) / interval)
+                throw std::runtime_error("wrong number of dictionary resets");
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what() << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
+// decodes ranges of each file: from the start, across a dictionary reset, in the middle and past the end
+struct RangeTester
+{
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            auto prop = ifs.get();
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+            std::vector<lzma::Byte> expected(seqGen.seq_len);
+            auto size = expected.size();
+            seqGen(&expected[0], size);
+
+            auto index = lzma::ScanChunks(&packed[0], packed.size());
+            auto lastReset = index.chunks.back().unpackedOffset;
+            for (auto& chunk : index.chunks)
+            {
+                if (chunk.resetsDic)
+                    lastReset = chunk.unpackedOffset;
+            }
+
+            struct Range { std::uint64_t offset; std::size_t length; };
+            const Range ranges[] =
+            {
+                { 0, 100 },
+                { lastReset > 5 ? lastReset - 5 : 0, 10 },
+                { size / 2, 70000 },
+                { size - 10, 100 },
+                { size, 10 }
+            };
+
+            std::vector<lzma::Byte> out;
+            for (auto& range : ranges)
+            {
+                out.assign(range.length, 0);
+                auto written = lzma::Lzma2DecodeRange(&out[0], range.offset, range.length, &packed[0], packed.size(), prop, index);
+
+                auto expectedLen = (std::size_t)std::min<std::uint64_t>(range.length, size - range.offset);
+                if (written != expectedLen)
+                    throw std::runtime_error("wrong range size");
+
+                if (!std::equal(out.begin(), out.begin() + written, expected.begin() + (std::size_t)range.offset))
+                    throw std::runtime_error("range mismatch");
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what()  << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
+template<typename Decoder>
+bool rejectsCheckpoint(Decoder& decoder, const std::vector<lzma::Byte>& state, std::size_t size)
+{
+    try
+    {
+        decoder.RestoreCheckpoint(&state[0], size);
+    }
+    catch (std::invalid_argument&)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+// makes checkpoints every 4 MB, writes and reads them back, and reads ranges from them
+struct CheckpointTester
+{
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            auto prop = ifs.get();
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+            std::vector<lzma::Byte> expected(seqGen.seq_len);
+            auto size = expected.size();
+            seqGen(&expected[0], size);
+
+            auto index = lzma::ScanChunks(&packed[0], packed.size());
+            auto made = lzma::MakeCheckpoints(&packed[0], packed.size(), prop, 4 * 1024 * 1024, index);
+            auto sidecar = lzma::WriteCheckpoints(made);
+            auto checkpoints = lzma::ReadCheckpoints(&sidecar[0], sidecar.size());
+
+            if (checkpoints.size() != made.size() || (size >= 8 * 1024 * 1024 && seqGen.reset_interval == 0 && made.empty()))
+                throw std::runtime_error("wrong number of checkpoints");
+
+            struct Range { std::uint64_t offset; std::size_t length; };
+            std::vector<Range> ranges;
+            for (auto& checkpoint : checkpoints)
+            {
+                if (checkpoint.packedOffset != made[&checkpoint - &checkpoints[0]].packedOffset ||
+                    checkpoint.state != made[&checkpoint - &checkpoints[0]].state)
+                {
+                    throw std::runtime_error("checkpoints don't read back");
+                }
+
+                Range at = { checkpoint.unpackedOffset, 1000 }, across = { checkpoint.unpackedOffset - 10, 20 }, after = { checkpoint.unpackedOffset + 12345, 70000 };
+                ranges.push_back(at);
+                ranges.push_back(across);
+                ranges.push_back(after);
+            }
+
+            Range tail = { size - 10, 100 };
+            ranges.push_back(tail);
+
+            std::vector<lzma::Byte> out;
+            for (auto& range : ranges)
+            {
+                out.assign(range.length, 0);
+                auto written = lzma::Lzma2DecodeRange(&out[0], range.offset, range.length, &packed[0], packed.size(), prop, index, checkpoints);
+
+                auto expectedLen = (std::size_t)std::min<std::uint64_t>(range.length, size - range.offset);
+                if (written != expectedLen || !std::equal(out.begin(), out.begin() + written, expected.begin() + (std::size_t)range.offset))
+                    throw std::runtime_error("range mismatch");
+            }
+
+            if (!checkpoints.empty())
+            {
+                lzma::Decoder2 decoder(prop);
+                std::vector<lzma::Byte> dic(decoder.decoder.m_properties.dicSize);
+                decoder.decoder.m_dic.mem = &dic[0];
+                decoder.decoder.m_dic.size = dic.size();
+
+                auto& state = checkpoints.back().state;
+                for (std::size_t truncated = 0; truncated != 48; ++truncated)
+                {
+                    if (!rejectsCheckpoint(decoder, state, truncated))
+                        throw std::runtime_error("checkpoint truncated in the header is accepted");
+                }
+
+                if (!rejectsCheckpoint(decoder, state, state.size() - 1))
+                    throw std::runtime_error("truncated checkpoint is accepted");
+
+                // rep0 past the window, when the next chunk doesn't reset the state
+                if ((state[2] & (2 | 8)) == 0)
+                {
+                    for (auto rep : { 0u, 0x01000100u, 0x02000000u })
+                    {
+                        auto badReps = state;
+                        for (auto i = 0; i != 4; ++i)
+                            badReps[20 + i] = lzma::Byte(rep >> (8 * i));
+                        if (!rejectsCheckpoint(decoder, badReps, badReps.size()))
+                            throw std::runtime_error("checkpoint with a rep past the window is accepted");
+                    }
+                }
+
+                // the probabilities are in another order
+                lzma::BasicDecoder2<lzma::GroupedProbsTraits> grouped(prop);
+                grouped.decoder.m_dic.mem = &dic[0];
+                grouped.decoder.m_dic.size = dic.size();
+                if (!rejectsCheckpoint(grouped, state, state.size()))
+                    throw std::runtime_error("checkpoint of another layout is accepted");
+
+                // a checkpoint is rejected as a whole: here its window doesn't fit, which is checked last
+                lzma::Decoder2 small(prop);
+                lzma::Byte smallDic[1];
+                small.decoder.m_dic.mem = smallDic;
+                small.decoder.m_dic.size = sizeof(smallDic);
+                auto before = small.SaveCheckpoint();
+                if (state.size() > 48 + sizeof(smallDic) && (!rejectsCheckpoint(small, state, state.size()) || small.SaveCheckpoint() != before))
+                    throw std::runtime_error("rejected checkpoint changes the decoder");
+
+                if (rejectsCheckpoint(decoder, state, state.size()))
+                    throw std::runtime_error("checkpoint is rejected");
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what()  << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
+// decodes each file with one Lzma2Decode call, the input is padded for the fast mode
+struct OneShotTester
+{
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            auto prop = ifs.get();
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+            auto packedSize = packed.size();
+            packed.resize(packedSize + lzma::InputPaddingSize);
+
+            std::vector<lzma::Byte> out(seqGen.seq_len + 1);
+            auto outLen = out.size();
+            std::size_t srcLen;
+            lzma::Status status;
+            lzma::InputSpan input = { &packed[0], packedSize, lzma::InputPaddingSize };
+
+            if (!lzma::Lzma2Decode(&out[0], outLen, input, srcLen, prop, lzma::FinishMode::End, status))
+                throw std::runtime_error("incomplete stream");
+
+            if (status != lzma::Status::FinishedWithMark || srcLen != packedSize)
+                throw std::runtime_error("wrong status");
+
+            seqGen.compare(&out[0], outLen);
+            if (!seqGen.empty())
+                throw std::runtime_error("stream is too short");
+
+            // a truncated stream must ask for more input, not run into the padding
+            input.size = packedSize - 2;
+            outLen = out.size();
+            if (lzma::Lzma2Decode(&out[0], outLen, input, srcLen, prop, lzma::FinishMode::End, status))
+                throw std::runtime_error("truncated stream is accepted");
         }
         catch (std::exception& e)
         {
@@ -91,17 +490,544 @@ std::string decode(const char (&src)[N])
     auto outLen = sizeof(out);
     auto encodedLen = N;
     lzma::Lzma2Decode(out, outLen, src, encodedLen, prop, lzma::FinishMode::End, status);
-    assert(status == lzma::Status::FinishedWithMark);
+    if (status != lzma::Status::FinishedWithMark)
+        throw std::runtime_error("decode: the stream is not finished");
     return std::string(out, outLen);
 }
 
+// feeds src byte by byte, so the chunk headers are parsed one byte at a time
+template<std::size_t N>
+std::string decodeByteByByte(const char (&src)[N])
+{
+    lzma::Byte dict[1024];
+    lzma::Decoder2 decoder(0x18);
+    decoder.decoder.m_dic.mem = dict;
+    decoder.decoder.m_dic.size = sizeof(dict);
+
+    lzma::Status status;
+    for (std::size_t i = 0; i != N; ++i)
+    {
+        std::size_t srcLen = 1;
+        decoder.DecodeToDic(sizeof(dict), src + i, srcLen, lzma::FinishMode::End, status);
+    }
+
+    if (status != lzma::Status::FinishedWithMark)
+        throw std::runtime_error("decodeByteByByte: the stream is not finished");
+    return std::string((const char*)dict, decoder.decoder.m_dic.pos);
+}
+
+template<typename Exception, typename F>
+bool throws(F f)
+{
+    try
+    {
+        f();
+    }
+    catch (Exception&)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+template<typename F>
+bool throwsBadStream(F f)
+{
+    return throws<lzma::BadStream>(f);
+}
+
+// GuessTracker that checks itself against a byte by byte record of the bytes which depend on the guessed ones
+struct CheckedGuessTracker : lzma::details::GuessTracker
+{
+    std::vector<char> guessed; ///< by dictionary position
+    bool missed;
+
+    CheckedGuessTracker() : missed(false) {}
+
+    // goes on after GuessMissed: the guessed bytes are the real ones here
+    void OnRead(std::size_t pos, unsigned mask)
+    {
+        auto stopped = false;
+        try
+        {
+            GuessTracker::OnRead(pos, mask);
+        }
+        catch (lzma::details::GuessMissed&)
+        {
+            stopped = true;
+        }
+
+        missed |= (mask != 0 && guessed[pos] && !stopped);
+    }
+
+    void OnCopy(std::size_t dest, std::size_t src, std::size_t len)
+    {
+        auto numCopies = copies.size();
+        GuessTracker::OnCopy(dest, src, len);
+
+        // the bytes before start are decoded too, but stay guessed or known
+        auto any = false;
+        for (auto i = (dest < start) ? start - dest : 0; i < len; ++i)
+            any |= (guessed[dest + i] = guessed[src + i]);
+
+        missed |= (any && copies.size() == numCopies);
+    }
+};
+
+struct CheckedGuessTraits : lzma::LinearTraits
+{
+    typedef CheckedGuessTracker Tracker;
+};
+
+// Pretends that the first eighth of the output is guessed but for a known range in it: the tracker must
+// stop at every read of a byte which depends on the guesses, and the recorded copies must rebuild every such byte.
+inline void checkGuessTracker(const std::vector<char>& packed, unsigned prop, const std::vector<lzma::Byte>& expected, std::size_t outLen)
+{
+    lzma::BasicDecoder2<CheckedGuessTraits> decoder(prop);
+    std::vector<lzma::Byte> out(outLen + 1);
+    decoder.decoder.m_dic.mem = &out[0];
+    decoder.decoder.m_dic.size = out.size();
+
+    auto& tracker = decoder.decoder.m_tracker;
+    tracker.start = outLen / 8;
+    tracker.end = out.size();
+    lzma::details::GuessTracker::Range known = { tracker.start / 2, tracker.start / 2 + tracker.start / 4 };
+    tracker.known.push_back(known);
+
+    tracker.guessed.assign(out.size(), 0);
+    std::fill(tracker.guessed.begin(), tracker.guessed.begin() + tracker.start, 1);
+    std::fill(tracker.guessed.begin() + known.begin, tracker.guessed.begin() + known.end, 0);
+
+    auto srcLen = packed.size();
+    lzma::Status status;
+    decoder.DecodeToDic(out.size(), &packed[0], srcLen, lzma::FinishMode::End, status);
+
+    if (tracker.missed)
+        throw std::runtime_error("a guessed byte is not tracked");
+
+    for (auto& copy : tracker.copies)
+        std::fill(&out[copy.dest], &out[copy.dest] + copy.len, lzma::Byte(0xA5));
+
+    for (auto& copy : tracker.copies)
+        lzma::details::CopyMatch(&out[copy.dest], &out[copy.src], copy.len);
+
+    if (!std::equal(expected.begin(), expected.begin() + outLen, out.begin()))
+        throw std::runtime_error("the recorded copies don't rebuild the output");
+}
+
+// decodes each file on several threads, at dictionary resets and speculatively at state resets
+struct ParallelTester
+{
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            auto prop = ifs.get();
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+            std::vector<lzma::Byte> out(seqGen.seq_len + 1);
+            auto outLen = out.size();
+            auto srcLen = packed.size();
+            lzma::Lzma2DecodeParallel(&out[0], outLen, &packed[0], srcLen, prop, 4);
+
+            if (srcLen != packed.size())
+                throw std::runtime_error("wrong stream size");
+
+            // one thread decodes the same
+            std::vector<lzma::Byte> serial(out.size());
+            auto serialLen = serial.size();
+            srcLen = packed.size();
+            lzma::Lzma2DecodeParallel(&serial[0], serialLen, &packed[0], srcLen, prop, 1);
+            if (serialLen != outLen || !std::equal(out.begin(), out.begin() + outLen, serial.begin()))
+                throw std::runtime_error("one thread decodes differently");
+
+            std::vector<lzma::Byte> speculative(out.size());
+            auto speculativeLen = speculative.size();
+            srcLen = packed.size();
+            auto misses = lzma::Lzma2DecodeSpeculative(&speculative[0], speculativeLen, &packed[0], srcLen, prop, 4);
+            if (speculativeLen != outLen || !std::equal(out.begin(), out.begin() + outLen, speculative.begin()))
+                throw std::runtime_error("speculative decoding differs");
+
+            // after a stored chunk the first literal is known, so some segments must decode ahead
+            auto index = lzma::ScanChunks(&packed[0], packed.size());
+            auto segments = lzma::SplitAtDicResets(index);
+            auto stateResets = lzma::SplitAtStateResets(index).size() - segments.size();
+            if (seqGen.stored_resets_state && (stateResets < 2 || misses == stateResets))
+                throw std::runtime_error("no speculation hits at state resets");
+
+            // with lc > 0 the segments after LZMA chunks are decoded in order
+            if (seqGen.chunks_reset_state && (stateResets < 2 || misses != stateResets))
+                throw std::runtime_error("a segment after an LZMA chunk decodes ahead");
+
+            checkGuessTracker(packed, prop, out, outLen);
+
+            seqGen.compare(&out[0], outLen);
+            if (!seqGen.empty())
+                throw std::runtime_error("stream is too short");
+
+            // a bad segment fails the whole call, whichever thread decodes it
+            auto& chunk = index.chunks[segments.back().firstChunk];
+            if (segments.size() > 1 && chunk.type == lzma::ChunkType::Lzma)
+            {
+                packed[chunk.packedOffset + 6] = 1; // the range coder starts with a zero byte
+                outLen = out.size();
+                srcLen = packed.size();
+                if (!throwsBadStream([&]{ lzma::Lzma2DecodeParallel(&out[0], outLen, &packed[0], srcLen, prop, 4); }))
+                    throw std::runtime_error("bad segment is accepted");
+
+                outLen = out.size();
+                srcLen = packed.size();
+                if (!throwsBadStream([&]{ lzma::Lzma2DecodeSpeculative(&out[0], outLen, &packed[0], srcLen, prop, 4); }))
+                    throw std::runtime_error("bad segment is accepted by the speculative decoder");
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what()  << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
+// cuts each file at its dictionary resets into streams of their own, and decodes them in one batch
+// of interleaved lanes, with a bad stream in the middle
+struct BatchTester
+{
+    template<typename SeqGen>
+    void operator()(std::string testName, SeqGen&& seqGen)
+    {
+        std::cout << testName << " : ";
+
+        try
+        {
+            std::ifstream ifs(testName + ".lzma2", std::ios_base::binary);
+            if (!ifs)
+                throw std::runtime_error("can't open file");
+
+            auto prop = ifs.get();
+            std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+            auto index = lzma::ScanChunks(&packed[0], packed.size());
+            std::vector<std::vector<char>> streams;
+            std::vector<std::vector<lzma::Byte>> outs;
+            for (auto& segment : lzma::SplitAtDicResets(index))
+            {
+                auto& first = index.chunks[segment.firstChunk];
+                auto& last = index.chunks[segment.firstChunk + segment.numChunks - 1];
+                streams.emplace_back(packed.begin() + first.packedOffset, packed.begin() + last.packedOffset + last.packedSize);
+                streams.back().push_back(0);
+                outs.emplace_back(last.unpackedOffset + last.unpackedSize - first.unpackedOffset);
+            }
+
+            const char badControl[] = { 3, 0, 7, 0, 0, 0, 0, 0 };
+            auto badPos = streams.size() / 2;
+            streams.emplace(streams.begin() + badPos, badControl, badControl + sizeof(badControl));
+            outs.emplace(outs.begin() + badPos, 16);
+
+            std::vector<lzma::BatchItem> items;
+            for (std::size_t i = 0; i != streams.size(); ++i)
+            {
+                lzma::BatchItem item = { &streams[i][0], streams[i].size(), &outs[i][0], outs[i].size(), (unsigned)prop, lzma::Status::NotSpecified, false };
+                items.push_back(item);
+            }
+
+            if (lzma::Lzma2DecodeBatch<3>(&items[0], items.size()) != 1 || !items[badPos].bad)
+                throw std::runtime_error("the bad stream is not found");
+
+            for (std::size_t i = 0; i != items.size(); ++i)
+            {
+                if (i == badPos)
+                    continue;
+
+                auto& item = items[i];
+                if (item.bad || item.status != lzma::Status::FinishedWithMark || item.srcLen != streams[i].size() || item.destLen != outs[i].size())
+                    throw std::runtime_error("a stream is not decoded");
+
+                seqGen.compare(&outs[i][0], item.destLen);
+            }
+
+            if (!seqGen.empty())
+                throw std::runtime_error("stream is too short");
+        }
+        catch (std::exception& e)
+        {
+            std::cout << " FAILED :\n\t" << e.what()  << std::endl;
+            return;
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+};
+
 void test_Lzma2Decode()
 {
     const char encodedEmpty[] = {0};
-    assert(decode(encodedEmpty) == "");
+    if (decode(encodedEmpty) != "")
+        throw std::runtime_error("Lzma2Decode: the empty stream");
+
+    const char encodedStr[] = {1, 0, 7, 't', 'e', 's', 't', '_', 's', 't', 'r', 0};
+    if (decode(encodedStr) != "test_str" || decodeByteByByte(encodedStr) != "test_str")
+        throw std::runtime_error("Lzma2Decode: a stored chunk");
+
+    // bad headers: an unknown control byte, and an LZMA chunk before any props
+    const char badControl[] = {3, 0, 7, 0, 0, 0, 0, 0};
+    const char noProps[] = {(char)0x80, 0, 7, 0, 0, 0, 0, 0};
+    if (!throwsBadStream([&]{ decode(badControl); }) || !throwsBadStream([&]{ decodeByteByByte(badControl); }))
+        throw std::runtime_error("Lzma2Decode: an unknown control byte");
+    if (!throwsBadStream([&]{ decode(noProps); }) || !throwsBadStream([&]{ decodeByteByByte(noProps); }))
+        throw std::runtime_error("Lzma2Decode: an LZMA chunk before any props");
+
+    auto index = lzma::ScanChunks(encodedStr, sizeof(encodedStr));
+    if (index.chunks.size() != 1 || index.unpackedSize != 8 || index.packedSize != sizeof(encodedStr) ||
+        index.chunks[0].type != lzma::ChunkType::Stored || !index.chunks[0].resetsDic)
+    {
+        throw std::runtime_error("ScanChunks: a stored chunk");
+    }
+
+    if (!throwsBadStream([&]{ lzma::ScanChunks(encodedStr, sizeof(encodedStr) - 1); }) ||
+        !throwsBadStream([&]{ lzma::ScanChunks(badControl, sizeof(badControl)); }) ||
+        !throwsBadStream([&]{ lzma::ScanChunks(noProps, sizeof(noProps)); }))
+    {
+        throw std::runtime_error("ScanChunks: a bad stream");
+    }
+}
+
+void test_CopyMatch()
+{
+    std::vector<lzma::Byte> expected(256), actual(256);
+    for (auto distance = 1u; distance <= 64; ++distance)
+    {
+        for (auto len = 1u; len <= 128; ++len)
+        {
+            for (auto i = 0u; i < expected.size(); ++i)
+                expected[i] = actual[i] = lzma::Byte(i * 7 + 3);
+
+            const auto pos = 100u;
+            for (auto i = 0u; i < len; ++i)
+                expected[pos + i] = expected[pos - distance + i];
+
+            lzma::details::CopyMatch(&actual[pos], &actual[pos - distance], len);
+            if (actual != expected)
+                throw std::runtime_error("CopyMatch: distance " + std::to_string(distance) + ", length " + std::to_string(len));
+        }
+    }
+}
+
+// hands out one block of memory, and counts what is taken
+struct ArenaResource : lzma::MemoryResource
+{
+    explicit ArenaResource(std::size_t size) : block(size), used(0), allocations(0), outstanding(0) {}
+
+    std::vector<lzma::Byte> block;
+    std::size_t used, allocations, outstanding;
+
+    virtual void* Allocate(std::size_t size, std::size_t alignment) override
+    {
+        used = (used + alignment - 1) / alignment * alignment;
+        if (block.size() - used < size)
+            throw std::bad_alloc();
+
+        auto p = &block[used];
+        used += size;
+        ++allocations;
+        outstanding += size;
+        return p;
+    }
+
+    virtual void Deallocate(void*, std::size_t size, std::size_t) override { outstanding -= size; }
+};
+
+// decodes src in 10 byte calls, so the ring gets the output of each call
+inline std::string decodeToBuf(lzma::BufDecoder2& decoder, const std::vector<char>& src)
+{
+    std::string out;
+    lzma::Status status;
+    for (std::size_t pos = 0; ; )
+    {
+        char buf[10];
+        auto destLen = sizeof(buf);
+        auto srcLen = src.size() - pos;
+        decoder.DecodeToBuf(buf, destLen, &src[pos], srcLen, lzma::FinishMode::Any, status);
+        pos += srcLen;
+        out.append(buf, destLen);
+
+        if (status == lzma::Status::FinishedWithMark || (srcLen == 0 && destLen == 0))
+            return out;
+    }
+}
+
+void test_MemoryResources()
+{
+    // one stored chunk of 100 bytes
+    std::vector<char> encoded = { 1, 0, 99 };
+    std::string expected;
+    for (auto i = 0; i != 100; ++i)
+        expected += char('a' + i % 26);
+    encoded.insert(encoded.end(), expected.begin(), expected.end());
+    encoded.push_back(0);
+
+    auto needs = lzma::BufDecoder2::GetMemoryNeeds(0x18);
+    if (needs.dicSize != 16 * 1024 * 1024 || needs.probsSize != lzma::Decoder2::GetMemoryNeeds(40).probsSize)
+        throw std::runtime_error("GetMemoryNeeds");
+
+    // the probabilities and the growing ring come from the arena, and go back to it
+    ArenaResource arena(1024 * 1024);
+    {
+        lzma::BufDecoder2 decoder(0x18, 16, arena);
+        if (decodeToBuf(decoder, encoded) != expected || arena.allocations <= 2 || decoder.GetDicBufSize() < expected.size())
+            throw std::runtime_error("the ring doesn't grow from the arena");
+    }
+    if (arena.outstanding != 0)
+        throw std::runtime_error("the arena's memory is not given back");
+
+    // decoded by one call, the stream leaves nothing to refer to: only the probabilities are allocated
+    {
+        ArenaResource oneCall(1024 * 1024);
+        lzma::BufDecoder2 decoder(0x18, oneCall);
+        std::string out(expected.size(), '-');
+        auto destLen = out.size();
+        auto srcLen = encoded.size();
+        lzma::Status status;
+        decoder.DecodeToBuf(&out[0], destLen, &encoded[0], srcLen, lzma::FinishMode::End, status);
+        if (out != expected || status != lzma::Status::FinishedWithMark || oneCall.allocations != 1 || decoder.GetDicBufSize() != 0)
+            throw std::runtime_error("a one-call decode allocates the ring");
+    }
+
+    std::vector<std::uint16_t> probs(needs.probsSize / sizeof(std::uint16_t));
+    lzma::Decoder2 decoder(0x18, &probs[0], needs.probsSize);
+    lzma::Byte dict[128];
+    decoder.decoder.m_dic.mem = dict;
+    decoder.decoder.m_dic.size = sizeof(dict);
+    auto srcLen = encoded.size();
+    lzma::Status status;
+    decoder.DecodeToDic(sizeof(dict), &encoded[0], srcLen, lzma::FinishMode::End, status);
+    if (status != lzma::Status::FinishedWithMark || std::string((const char*)dict, decoder.decoder.m_dic.pos) != expected)
+        throw std::runtime_error("a decoder with the caller's probabilities");
+
+    if (!throws<std::invalid_argument>([&]{ lzma::Decoder2 small(0x18, &probs[0], needs.probsSize - 1); }))
+        throw std::runtime_error("too few probabilities are taken");
+
+    // the caller's ring doesn't grow
+    std::vector<lzma::Byte> ring(64);
+    lzma::BufDecoder2 bufDecoder(0x18, &probs[0], needs.probsSize, &ring[0], ring.size());
+    if (!throws<std::length_error>([&]{ decodeToBuf(bufDecoder, encoded); }))
+        throw std::runtime_error("the caller's ring grows");
+}
+
+void test_DecoderPool()
+{
+    std::vector<char> encoded = { 1, 0, 99 };
+    std::string expected;
+    for (auto i = 0; i != 100; ++i)
+        expected += char('a' + i % 26);
+    encoded.insert(encoded.end(), expected.begin(), expected.end());
+    encoded.push_back(0);
+
+    // Reset(prop) keeps the ring: a smaller dictionary uses part of it, a larger one all of it again
+    ArenaResource arena(4 * 1024 * 1024);
+    lzma::BufDecoder2 decoder(0x18, 1024 * 1024, arena);
+    if (decodeToBuf(decoder, encoded) != expected)
+        throw std::runtime_error("Reset(prop): the first stream");
+    auto allocations = arena.allocations;
+    decoder.Reset(0);
+    if (decoder.GetDicBufSize() != 4096 || decodeToBuf(decoder, encoded) != expected)
+        throw std::runtime_error("Reset(prop): a smaller dictionary");
+    decoder.Reset(0x18);
+    if (decoder.GetDicBufSize() != 1024 * 1024 || decodeToBuf(decoder, encoded) != expected)
+        throw std::runtime_error("Reset(prop): a larger dictionary");
+    if (arena.allocations != allocations)
+        throw std::runtime_error("Reset(prop) allocates");
+
+    if (!throws<std::invalid_argument>([&]{ decoder.Reset(41); }))
+        throw std::runtime_error("Reset(prop): an invalid prop");
+
+    // a decoder given back comes out again for a prop of the same size class
+    lzma::DecoderPool<lzma::BufDecoder2> pool(1);
+    lzma::BufDecoder2* first;
+    {
+        auto pooled = pool.Acquire(0x18);
+        first = pooled.get();
+        if (decodeToBuf(*pooled, encoded) != expected)
+            throw std::runtime_error("DecoderPool: a pooled decoder");
+    }
+    if (pool.Size() != 1)
+        throw std::runtime_error("DecoderPool: the decoder is not given back");
+    {
+        auto same = pool.Acquire(0x19);
+        auto other = pool.Acquire(0x10);
+        if (same.get() != first || other.get() == first || decodeToBuf(*same, encoded) != expected)
+            throw std::runtime_error("DecoderPool: the size classes");
+        auto extra = pool.Acquire(0x18);
+        if (extra.get() == first)
+            throw std::runtime_error("DecoderPool: a decoder is handed out twice");
+    }
+    if (pool.Size() != 2)
+        throw std::runtime_error("DecoderPool: more than maxPerClass decoders are kept");
+
+#if defined(LZMA_HAS_THREAD_LOCAL)
+    typedef lzma::DecoderPool<lzma::BufDecoder2> Pool;
+    const Pool* otherPool = nullptr;
+    std::thread([&]{ otherPool = &Pool::ThreadLocal(); }).join();
+    if (&Pool::ThreadLocal() != &Pool::ThreadLocal() || otherPool == &Pool::ThreadLocal())
+        throw std::runtime_error("DecoderPool::ThreadLocal");
+#endif
+}
+
+template<std::size_t NumLanes>
+void test_Lzma2DecodeBatch()
+{
+    if (lzma::Lzma2DecodeBatch<NumLanes>(nullptr, 0) != 0)
+        throw std::runtime_error("Lzma2DecodeBatch: an empty batch");
 
     const char encodedStr[] = {1, 0, 7, 't', 'e', 's', 't', '_', 's', 't', 'r', 0};
-    assert(decode(encodedStr) == "test_str");
+    const char badControl[] = {3, 0, 7, 0, 0, 0, 0, 0};
+
+    // more streams than lanes: a bad and a truncated one don't stop the others
+    const std::size_t count = NumLanes + 3;
+    std::vector<std::string> outs(count, std::string(16, '-'));
+    std::vector<lzma::BatchItem> items;
+    for (std::size_t i = 0; i != count; ++i)
+    {
+        lzma::BatchItem item = { encodedStr, sizeof(encodedStr), &outs[i][0], outs[i].size(), 0, lzma::Status::NotSpecified, false };
+        items.push_back(item);
+    }
+    items[1].src = badControl;
+    items[1].srcLen = sizeof(badControl);
+    items[2].srcLen = 5;
+
+    if (lzma::Lzma2DecodeBatch<NumLanes>(&items[0], count) != 1 || !items[1].bad || items[1].status != lzma::Status::NotSpecified)
+        throw std::runtime_error("Lzma2DecodeBatch: the bad stream");
+    if (items[2].bad || items[2].status != lzma::Status::NeedsMoreInput || items[2].srcLen != 5 || outs[2].substr(0, items[2].destLen) != "te")
+        throw std::runtime_error("Lzma2DecodeBatch: the truncated stream");
+
+    for (std::size_t i = 0; i != count; ++i)
+    {
+        if (i == 1 || i == 2)
+            continue;
+
+        if (items[i].bad || items[i].status != lzma::Status::FinishedWithMark || items[i].srcLen != sizeof(encodedStr) ||
+            outs[i].substr(0, items[i].destLen) != "test_str")
+        {
+            throw std::runtime_error("Lzma2DecodeBatch: a stream is not decoded");
+        }
+    }
+
+    // an invalid prop is found before anything is decoded
+    items[0].prop = 41;
+    outs[3] = std::string(16, '-');
+    items[3].destLen = outs[3].size();
+    if (!throws<std::invalid_argument>([&]{ lzma::Lzma2DecodeBatch<NumLanes>(&items[0], count); }) || outs[3] != std::string(16, '-'))
+        throw std::runtime_error("Lzma2DecodeBatch: an invalid prop");
 }
 
 int main()
@@ -109,11 +1035,92 @@ int main()
     try
     {
         test_Lzma2Decode();
+        test_CopyMatch();
+        test_MemoryResources();
+        test_DecoderPool();
+        test_Lzma2DecodeBatch<1>();
+        test_Lzma2DecodeBatch<4>();
 
         std::cout << "decoding files..." << std::endl;
-        Tester tester;
+        Tester<lzma::Decoder2> tester;
         run_tests(tester);
 
+        std::cout << "decoding files with 32-bit probabilities..." << std::endl;
+        Tester<lzma::Decoder2Prob32> tester32;
+        run_tests(tester32);
+
+        std::cout << "decoding files fed in 1 and 7 byte blocks..." << std::endl;
+        Tester<lzma::Decoder2> byteTester(1);
+        run_tests(byteTester);
+        Tester<lzma::Decoder2> smallBlockTester(7);
+        run_tests(smallBlockTester);
+
+        std::cout << "decoding files in 7 byte blocks without CPU dispatch..." << std::endl;
+        Tester<lzma::BasicDecoder2<BaselineCpuTraits>> baselineTester(7);
+        run_tests(baselineTester);
+
+        std::cout << "decoding files with the wide range coder..." << std::endl;
+        Tester<lzma::Decoder2WideRc> wideRcTester;
+        run_tests(wideRcTester);
+        Tester<lzma::Decoder2WideRc> wideRcByteTester(1);
+        run_tests(wideRcByteTester);
+        Tester<lzma::Decoder2WideRc> wideRcSmallBlockTester(7);
+        run_tests(wideRcSmallBlockTester);
+
+        std::cout << "decoding files in 7 byte blocks with branchless bit trees..." << std::endl;
+        Tester<lzma::Decoder2Branchless> branchlessTester(7);
+        run_tests(branchlessTester);
+
+        std::cout << "decoding files with grouped probabilities..." << std::endl;
+        Tester<lzma::Decoder2GroupedProbs> groupedTester;
+        run_tests(groupedTester);
+
+        std::cout << "decoding files with prefetching..." << std::endl;
+        Tester<lzma::Decoder2Prefetch> prefetchTester;
+        run_tests(prefetchTester);
+
+        std::cout << "decoding files in 7 byte blocks with stats..." << std::endl;
+        Tester<lzma::Decoder2Stats> statsTester(7);
+        run_tests(statsTester);
+
+        std::cout << "decoding files to 1000 byte, 3 MB and 40 MB buffers..." << std::endl;
+        BufTester<lzma::BufDecoder2Stats> bufTester(4096, { 1000 });
+        run_tests(bufTester);
+        BufTester<lzma::BufDecoder2> bigBufTester(64 * 1024, { 3 * 1024 * 1024 });
+        run_tests(bigBufTester);
+        // past a dictionary size of a call, the rest is decoded in place
+        BufTester<lzma::BufDecoder2Stats> inPlaceBufTester(1024 * 1024, { 1000, 40 * 1024 * 1024 });
+        run_tests(inPlaceBufTester);
+        BufTester<lzma::BufDecoder2> wholeBufTester(64 * 1024 * 1024, { 64 * 1024 * 1024 });
+        run_tests(wholeBufTester);
+        // the ring starts at the hint and grows past it
+        BufTester<lzma::BufDecoder2> hintedBufTester(4096, { 1000 }, 3);
+        run_tests(hintedBufTester);
+
+        std::cout << "indexing files..." << std::endl;
+        ScanTester scanTester;
+        run_tests(scanTester);
+
+        std::cout << "decoding byte ranges..." << std::endl;
+        RangeTester rangeTester;
+        run_tests(rangeTester);
+
+        std::cout << "seeking from checkpoints..." << std::endl;
+        CheckpointTester checkpointTester;
+        run_tests(checkpointTester);
+
+        std::cout << "decoding files on several threads..." << std::endl;
+        ParallelTester parallelTester;
+        run_tests(parallelTester);
+
+        std::cout << "decoding the segments of files in a batch..." << std::endl;
+        BatchTester batchTester;
+        run_tests(batchTester);
+
+        std::cout << "decoding files in one call..." << std::endl;
+        OneShotTester oneShotTester;
+        run_tests(oneShotTester);
+
         std::cout << "All done.\n" << std::endl;
     }
     catch (std::exception& e)
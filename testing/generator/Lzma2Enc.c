@@ -42,6 +42,8 @@ typedef struct
   Byte props;
   Bool needInitState;
   Bool needInitProp;
+  Bool resetStateAfterCopy;
+  Bool resetStateEveryChunk;
 } CLzma2EncInt;
 
 static SRes Lzma2EncInt_Init(CLzma2EncInt *p, const CLzma2EncProps *props)
@@ -54,6 +56,8 @@ static SRes Lzma2EncInt_Init(CLzma2EncInt *p, const CLzma2EncProps *props)
   p->props = propsEncoded[0];
   p->needInitState = True;
   p->needInitProp = True;
+  p->resetStateAfterCopy = (props->resetStateAfterCopy != 0);
+  p->resetStateEveryChunk = (props->resetStateEveryChunk != 0);
   return SZ_OK;
 }
 
@@ -83,6 +87,9 @@ static SRes Lzma2EncInt_EncodeSubblock(CLzma2EncInt *p, Byte *outBuf,
   if (packSize < lzHeaderSize)
     return SZ_ERROR_OUTPUT_EOF;
   packSize -= lzHeaderSize;
+
+  if (p->resetStateEveryChunk)
+    p->needInitState = True;
   
   LzmaEnc_SaveState(p->enc);
   res = LzmaEnc_CodeOneMemBlock(p->enc, p->needInitState,
@@ -130,6 +137,8 @@ static SRes Lzma2EncInt_EncodeSubblock(CLzma2EncInt *p, Byte *outBuf,
         *packSizeRes = destPos;
       /* needInitState = True; */
     }
+    if (p->resetStateAfterCopy)
+      p->needInitState = True;
     LzmaEnc_RestoreState(p->enc);
     return SZ_OK;
   }
@@ -171,6 +180,8 @@ void Lzma2EncProps_Init(CLzma2EncProps *p)
   p->numTotalThreads = -1;
   p->numBlockThreads = -1;
   p->blockSize = 0;
+  p->resetStateAfterCopy = 0;
+  p->resetStateEveryChunk = 0;
 }
 
 void Lzma2EncProps_Normalize(CLzma2EncProps *p)
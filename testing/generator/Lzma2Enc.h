@@ -16,6 +16,8 @@ typedef struct
   size_t blockSize;
   int numBlockThreads;
   int numTotalThreads;
+  int resetStateAfterCopy; /* 1 - the LZMA chunk after a stored chunk resets the state, as xz does */
+  int resetStateEveryChunk; /* 1 - every LZMA chunk resets the state, so no segment follows a stored chunk */
 } CLzma2EncProps;
 
 void Lzma2EncProps_Init(CLzma2EncProps *p);
@@ -3,6 +3,7 @@
 
 #include "Lzma2Enc.h"
 
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -44,7 +45,7 @@ struct OutStream : ISeqOutStream
 };
 
 template<typename F>
-void lzma2_encode(F f, std::ostream& out, unsigned& properties)
+void lzma2_encode(F f, std::ostream& out, unsigned& properties, bool resetStateAfterCopy = false, bool resetStateEveryChunk = false)
 {
     auto enc = Lzma2Enc_Create(&alloc, &alloc);
     if (enc == 0)
@@ -52,6 +53,8 @@ void lzma2_encode(F f, std::ostream& out, unsigned& properties)
 
     CLzma2EncProps props;
     Lzma2EncProps_Init(&props);
+    props.resetStateAfterCopy = resetStateAfterCopy;
+    props.resetStateEveryChunk = resetStateEveryChunk;
     auto res = Lzma2Enc_SetProps(enc, &props);
     if (res != SZ_OK)
         throw std::runtime_error("failed to set LZMA encoder properties");
@@ -84,6 +87,32 @@ std::string lzma2_encode(const char* str, size_t available, unsigned& properties
     return ss.str();
 }
 
+// encodes every reset_interval bytes as a separate stream and joins them,
+// so each piece starts with a chunk that resets the dictionary and the state
+template<typename SeqGen>
+void lzma2_encode_pieces(SeqGen& seqGen, std::ostream& out, unsigned& properties)
+{
+    while (!seqGen.empty())
+    {
+        auto left = seqGen.reset_interval;
+        std::stringstream piece;
+        lzma2_encode([&](void* buf, size_t& size)
+        {
+            if (size > left)
+                size = left;
+
+            seqGen(buf, size);
+            left -= size;
+        }
+        , piece, properties);
+
+        auto str = piece.str();
+        out.write(str.data(), str.size() - 1); // without the end of stream byte
+    }
+
+    out.put(0);
+}
+
 struct TestGenerator
 {
     template<typename SeqGen>
@@ -99,7 +128,10 @@ struct TestGenerator
         ofs.put(0); // reserve space for properties
 
         unsigned props;
-        lzma2_encode(seqGen, ofs, props);
+        if (seqGen.reset_interval == 0)
+            lzma2_encode(seqGen, ofs, props, seqGen.stored_resets_state, seqGen.chunks_reset_state);
+        else
+            lzma2_encode_pieces(seqGen, ofs, props);
 
         ofs.seekp(0);
         ofs.put(static_cast<char>(props));
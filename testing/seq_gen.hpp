@@ -45,6 +45,78 @@ namespace rand_gen
     {
         return seq<RangeGen>(rangeGen, first);
     }
+
+    // text-like sequence: random words from a small vocabulary
+    struct words
+    {
+        LCG lcg;
+        const char* cur;
+
+        words() : cur("") {}
+
+        unsigned char operator()()
+        {
+            static const char* const vocab[] =
+            {
+                "the ", "decoder ", "reads ", "a ", "stream ", "of ", "bytes ", "and ",
+                "writes ", "them ", "to ", "the ", "dictionary, ", "then ", "repeats.\n", "ERROR: "
+            };
+
+            if (*cur == 0)
+                cur = vocab[lcg() % (sizeof(vocab) / sizeof(vocab[0]))];
+
+            return (unsigned char)*cur++;
+        }
+    };
+
+    // far repeats: random 64-byte phrases from a pool of 4 MB, so matches reach deep into the dictionary
+    struct phrases
+    {
+        LCG pick;
+        LCG body;
+        unsigned left;
+
+        phrases() : left(0) {}
+
+        unsigned char operator()()
+        {
+            if (left == 0)
+            {
+                unsigned index = (pick() << 16 | pick() << 8 | pick()) & 0xFFFF;
+                body.m_LCG_state = index + 1;
+                left = 64;
+            }
+
+            --left;
+            return body();
+        }
+    };
+
+    // text between stretches of random bytes, which the encoder stores and resets the state after, but not
+    // the dictionary; the letters move on after each stretch, so the text doesn't repeat the earlier text
+    struct words_noise
+    {
+        words text;
+        LCG noise;
+        unsigned pos;
+        unsigned char shift;
+
+        words_noise() : pos(0), shift(0) {}
+
+        unsigned char operator()()
+        {
+            const unsigned textSize = 192 * 1024, period = 320 * 1024;
+
+            auto at = pos;
+            if (++pos == period)
+            {
+                pos = 0;
+                shift += 37;
+            }
+
+            return at < textSize ? (unsigned char)(text() + shift) : noise();
+        }
+    };
 }
 
 namespace details
@@ -54,8 +126,32 @@ namespace details
     {
         Seq seq;
         size_t seq_len;
+        size_t reset_interval; ///< the encoder resets the dictionary and state every that many bytes, 0 - never
+        bool stored_resets_state; ///< the encoder resets the state after stored chunks, as xz does
+        bool chunks_reset_state;  ///< the encoder resets the state in every LZMA chunk
+
+        make_seq_gen_state(Seq s, size_t len) : seq(s), seq_len(len), reset_interval(0), stored_resets_state(false), chunks_reset_state(false) {}
+
+        make_seq_gen_state reset_every(size_t n) const
+        {
+            auto copy = *this;
+            copy.reset_interval = n;
+            return copy;
+        }
 
-        make_seq_gen_state(Seq s, size_t len) : seq(s), seq_len(len) {}
+        make_seq_gen_state reset_state_after_stored() const
+        {
+            auto copy = *this;
+            copy.stored_resets_state = true;
+            return copy;
+        }
+
+        make_seq_gen_state reset_state_every_chunk() const
+        {
+            auto copy = *this;
+            copy.chunks_reset_state = true;
+            return copy;
+        }
 
         void operator()(void* buf, size_t& n)
         {
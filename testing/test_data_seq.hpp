@@ -17,4 +17,13 @@ inline void run_tests(F&& test)
     
     test("seq_zero_20M", make_seq(rand_gen::make([]{ return 0; }, 0), 20 * 1024 * 1024));
     test("seq_slow_rand_20M", make_seq(rand_gen::make([]{ return 1; }, 0xAA), 20 * 1024 * 1024));
+
+    test("seq_words_16M", make_seq(rand_gen::words(), 16 * 1024 * 1024));
+    test("seq_rand_4M", make_seq(rand_gen::make([]{ return 256; }, 0xAA), 4 * 1024 * 1024));
+    test("seq_phrases_32M", make_seq(rand_gen::phrases(), 32 * 1024 * 1024));
+    test("seq_walk16_8M", make_seq(rand_gen::make([]{ return 16; }, 0x80), 8 * 1024 * 1024));
+    test("seq_words_reset64K_8M", make_seq(rand_gen::words(), 8 * 1024 * 1024).reset_every(64 * 1024));
+    test("seq_words_reset4K_1M", make_seq(rand_gen::words(), 1024 * 1024).reset_every(4 * 1024));
+    test("seq_words_noise_8M", make_seq(rand_gen::words_noise(), 8 * 1024 * 1024).reset_state_after_stored());
+    test("seq_words_state_resets_4M", make_seq(rand_gen::words(), 4 * 1024 * 1024).reset_state_every_chunk());
 }
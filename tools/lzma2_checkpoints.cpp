@@ -0,0 +1,55 @@
+// cpp-lzma sidecar checkpoint index
+// belongs to the public domain
+
+// Usage: lzma2_checkpoints <input> <interval in MB> <output>
+// The input is a prop byte followed by an LZMA2 stream, as in the test files.
+// The output is WriteCheckpoints of the stream, for Lzma2DecodeRange.
+
+#include <lzma-cpp/Lzma2Checkpoints.hpp>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+int main(int argc, char* argv[])
+{
+    if (argc != 4)
+    {
+        std::cout << "Usage: lzma2_checkpoints <input> <interval in MB> <output>\n";
+        return 2;
+    }
+
+    try
+    {
+        std::ifstream ifs(argv[1], std::ios_base::binary);
+        if (!ifs)
+            throw std::runtime_error(std::string("can't open file ") + argv[1]);
+
+        auto prop = ifs.get();
+        std::vector<char> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if (prop < 0 || packed.empty())
+            throw std::runtime_error("the input is empty");
+
+        auto interval = std::strtoull(argv[2], nullptr, 10) * 1024 * 1024;
+        if (interval == 0)
+            throw std::runtime_error("bad interval");
+
+        auto index = lzma::ScanChunks(&packed[0], packed.size());
+        auto checkpoints = lzma::MakeCheckpoints(&packed[0], packed.size(), prop, interval, index);
+        auto sidecar = lzma::WriteCheckpoints(checkpoints);
+
+        std::ofstream ofs(argv[3], std::ios_base::trunc | std::ios_base::binary);
+        if (!ofs.write((const char*)sidecar.data(), sidecar.size()))
+            throw std::runtime_error(std::string("can't write file ") + argv[3]);
+
+        std::cout << checkpoints.size() << " checkpoints, " << sidecar.size() << " bytes\n";
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}